@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#include "headers.h"
+
+static void balance_check(void *, void *);
+static void balance_receive(void *, void *);
+
+/*
+ * Every thread publishes the load of its event loop.  A thread whose
+ * load exceeds the least loaded one by more than the gap hands some of
+ * its connections over, each between two requests.  The receiver is
+ * woken by an eventfd and takes all the queued connections at once, so
+ * the queue needs no lock: senders push with a CAS, the receiver swaps
+ * the whole list out.
+ */
+static struct balance *balances;
+
+
+int
+balance_init(struct thread *threads)
+{
+    int i, fd;
+
+    balances = zcalloc(sizeof(struct balance) * cfg.threads);
+    if (balances == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < cfg.threads; i++) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd == -1) {
+            printf("eventfd() failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        balances[i].event.fd = fd;
+        threads[i].balance = &balances[i];
+    }
+
+    return 0;
+}
+
+
+void
+balance_start(struct thread *t, uint32_t conns)
+{
+    struct thread *thr = cur_thread();
+    struct balance *b = t->balance;
+
+    thr->balance = b;
+    b->conns = conns;
+
+    b->event.read_handler = balance_receive;
+    b->event.data = b;
+
+    if (epoll_add_event(thr->engine, &b->event, EVENT_READ)) {
+        return;
+    }
+
+    b->timer.handler = balance_check;
+    timer_add(thr->engine, &b->timer, BALANCE_INTERVAL);
+}
+
+
+static void
+balance_check(void *obj, void *data)
+{
+    struct thread *thr = cur_thread();
+    struct status *status = thr->engine->status;
+    struct balance *b = thr->balance;
+    struct balance *other;
+    int i, target;
+    uint32_t load, load_other, min, conns;
+    uint64_t busy, wait;
+
+    busy = status->loop_busy - b->busy;
+    wait = status->loop_wait - b->wait;
+
+    b->busy = status->loop_busy;
+    b->wait = status->loop_wait;
+
+    load = (busy + wait > 0) ? busy * 1000 / (busy + wait) : 0;
+    __atomic_store_n(&b->load, load, __ATOMIC_RELAXED);
+
+    target = -1;
+    min = load;
+
+    for (i = 0; i < cfg.threads; i++) {
+        other = &balances[i];
+
+        load_other = __atomic_load_n(&other->load, __ATOMIC_RELAXED);
+
+        if (other != b && load_other < min) {
+            min = load_other;
+            target = i;
+        }
+    }
+
+    b->moves = 0;
+    conns = __atomic_load_n(&b->conns, __ATOMIC_RELAXED);
+
+    /* Moving half the gap keeps the threads from trading places. */
+
+    if (target != -1 && load - min > BALANCE_GAP && conns > 1) {
+        b->target = target;
+        b->moves = max_int(conns * (load - min) / (2 * load), 1);
+    }
+
+    timer_add(thr->engine, &b->timer, BALANCE_INTERVAL);
+}
+
+
+/*
+ * Returns 1 when the idle connection is to be handed to another thread.
+ * It leaves once the events of the current wakeup are handled, as one
+ * of them may still refer to it.
+ */
+
+int
+balance_handoff(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+    struct balance *b = thr->balance;
+
+    if (b == NULL || b->moves == 0
+        || __atomic_load_n(&b->conns, __ATOMIC_RELAXED) <= 1)
+    {
+        return 0;
+    }
+
+    b->moves--;
+    __atomic_sub_fetch(&b->conns, 1, __ATOMIC_RELAXED);
+
+    epoll_delete_event(thr->engine, &c->socket, EVENT_READ | EVENT_WRITE);
+    thr->engine->status->handoffs++;
+    thr->engine->status->active--;
+
+    c->next = b->outgoing;
+    b->outgoing = c;
+
+    return 1;
+}
+
+
+void
+balance_flush(void)
+{
+    struct thread *thr = cur_thread();
+    struct balance *b = thr->balance;
+    struct balance *to;
+    struct conn *c, *next;
+    uint64_t val;
+
+    if (b == NULL || b->outgoing == NULL) {
+        return;
+    }
+
+    to = &balances[b->target];
+
+    for (c = b->outgoing; c != NULL; c = next) {
+        next = c->next;
+
+        __atomic_add_fetch(&to->conns, 1, __ATOMIC_RELAXED);
+
+        c->next = __atomic_load_n(&to->queue, __ATOMIC_RELAXED);
+
+        while (!__atomic_compare_exchange_n(&to->queue, &c->next, c, 1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+        {
+            /* void */
+        }
+    }
+
+    b->outgoing = NULL;
+
+    val = 1;
+    (void) write(to->event.fd, &val, sizeof(uint64_t));
+}
+
+
+static void
+balance_receive(void *obj, void *data)
+{
+    struct balance *b = data;
+    struct conn *c, *next;
+    uint64_t val;
+
+    /* The count is cleared first, a later push wakes the thread again. */
+    (void) read(b->event.fd, &val, sizeof(uint64_t));
+
+    c = __atomic_exchange_n(&b->queue, NULL, __ATOMIC_ACQUIRE);
+
+    while (c != NULL) {
+        next = c->next;
+        http_peer_adopt(c);
+        c = next;
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#ifndef BALANCE_H
+#define BALANCE_H
+
+/* The part of a thread that other threads hand connections to. */
+struct balance {
+    /* Connections pushed by the other threads, linked by next. */
+    struct conn *queue;
+    /* Connections of the thread to hand over after the current events. */
+    struct conn *outgoing;
+    file_event event;
+    struct timer timer;
+    /* The event loop busy time over the last interval, in per mille. */
+    uint32_t load;
+    uint32_t conns;
+    int target;
+    uint32_t moves;
+    uint64_t busy;
+    uint64_t wait;
+};
+
+int balance_init(struct thread *);
+void balance_start(struct thread *, uint32_t);
+int balance_handoff(struct conn *);
+void balance_flush(void);
+
+/* The interval of the load checks in ms. */
+#define BALANCE_INTERVAL  100
+/* The load gap in per mille above which connections move. */
+#define BALANCE_GAP       200
+
+#endif /* BALANCE_H */
@@ -0,0 +1,727 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#include "headers.h"
+
+/*
+ * A coordinator drives several workers over a blocking TCP control
+ * connection each.  Every message is a 32-bit big-endian type and
+ * length followed by the payload:
+ *
+ *   coordinator -> worker  CONFIG  token and argv, NUL separated
+ *   coordinator -> worker  SCRIPT  script file contents, may be empty
+ *   worker -> coordinator  READY   or ERROR with a text payload
+ *   coordinator -> worker  START   CLOCK_REALTIME nanoseconds to start at
+ *   worker -> coordinator  RESULT  elapsed time and the encoded status
+ */
+
+#define CLUSTER_CONFIG          1
+#define CLUSTER_SCRIPT          2
+#define CLUSTER_READY           3
+#define CLUSTER_START           4
+#define CLUSTER_RESULT          5
+#define CLUSTER_ERROR           6
+
+#define CLUSTER_MAX_MESSAGE     (256 * 1024 * 1024)
+
+/* Workers start together this long after the last one became ready. */
+#define CLUSTER_START_DELAY     500000000
+
+/* How long past the duration the coordinator waits for results. */
+#define CLUSTER_RESULT_TIMEOUT  60
+
+/* The token shared by the coordinator and its workers. */
+#define CLUSTER_TOKEN           "HTTP_TEST_TOKEN"
+
+static char *cluster_token(void);
+static int cluster_token_equal(char *, char *);
+static int cluster_session(int, char *);
+static int cluster_args(int, char **, char *, struct buf **);
+static int cluster_connect(char *);
+static int cluster_addr(char *, char **, char **);
+static int cluster_send(int, uint32_t, void *, size_t);
+static int cluster_write(int, void *, size_t);
+static int cluster_read(int, void *, size_t);
+static char *cluster_recv(int, uint32_t *, size_t *);
+static int cluster_error(int, char *);
+static char *cluster_file_read(char *, size_t *);
+
+
+static inline uint64_t
+realtime_time(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int
+cluster_worker(void)
+{
+    int fd, conn;
+    char *token;
+    pid_t pid;
+
+    token = cluster_token();
+    if (token == NULL) {
+        return -1;
+    }
+
+    fd = cluster_listen(cfg.worker);
+    if (fd == -1) {
+        return -1;
+    }
+
+    printf("Worker listening on %s\n", cfg.worker);
+    fflush(stdout);
+
+    signal(SIGCHLD, SIG_IGN);
+
+    for ( ;; ) {
+        conn = accept(fd, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            printf("accept() failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        /* Each session runs in a fresh copy of the idle worker. */
+        pid = fork();
+
+        if (pid == 0) {
+            close(fd);
+            exit(cluster_session(conn, token) ? 1 : 0);
+        }
+
+        if (pid == -1) {
+            printf("fork() failed: %s\n", strerror(errno));
+        }
+
+        close(conn);
+    }
+}
+
+
+/*
+ * A worker runs the options and script it is sent, so both sides must
+ * be given the same token in the environment.
+ */
+
+static char *
+cluster_token(void)
+{
+    char *token;
+
+    token = getenv(CLUSTER_TOKEN);
+
+    if (token == NULL || *token == '\0') {
+        printf("%s must be set to run a cluster\n", CLUSTER_TOKEN);
+        return NULL;
+    }
+
+    return token;
+}
+
+
+/* The time taken does not depend on where the tokens differ. */
+
+static int
+cluster_token_equal(char *p1, char *p2)
+{
+    size_t i, len1, len2;
+    u_char diff;
+
+    len1 = strlen(p1);
+    len2 = strlen(p2);
+
+    diff = (len1 != len2);
+
+    for (i = 0; i < len1; i++) {
+        diff |= p1[i] ^ p2[i % (len2 + 1)];
+    }
+
+    return diff == 0;
+}
+
+
+static int
+cluster_session(int fd, char *token)
+{
+    int argc;
+    char *p, *end, *data, *script, **argv;
+    size_t len;
+    uint32_t type;
+    uint64_t start, used;
+    lua_State *L;
+    struct timespec ts;
+    struct thread *threads;
+    struct status *status;
+
+    data = cluster_recv(fd, &type, &len);
+    if (data == NULL || type != CLUSTER_CONFIG) {
+        return -1;
+    }
+
+    end = data + len;
+
+    if (!cluster_token_equal(data, token)) {
+        return cluster_error(fd, "invalid token");
+    }
+
+    data += strlen(data) + 1;
+    argc = 0;
+
+    for (p = data; p < end; p += strlen(p) + 1) {
+        argc++;
+    }
+
+    argv = zcalloc(sizeof(char *) * (argc + 1));
+    if (argv == NULL) {
+        return -1;
+    }
+
+    argc = 0;
+
+    for (p = data; p < end; p += strlen(p) + 1) {
+        argv[argc++] = p;
+    }
+
+    script = cluster_recv(fd, &type, &len);
+    if (script == NULL || type != CLUSTER_SCRIPT) {
+        return -1;
+    }
+
+    if (len > 0) {
+        cfg.script_data = script;
+        cfg.script_size = len;
+    }
+
+    cfg.worker = NULL;
+    optind = 0;
+
+    if (config_init(argc, argv)) {
+        return cluster_error(fd, "invalid configuration");
+    }
+
+    L = script_create();
+    if (L == NULL) {
+        return cluster_error(fd, "invalid script");
+    }
+
+    lua_close(L);
+
+    if (cluster_send(fd, CLUSTER_READY, NULL, 0)) {
+        return -1;
+    }
+
+    data = cluster_recv(fd, &type, &len);
+    if (data == NULL || type != CLUSTER_START || len != sizeof(uint64_t)) {
+        return -1;
+    }
+
+    memcpy(&start, data, sizeof(uint64_t));
+    start = be64toh(start);
+
+    ts.tv_sec = start / 1000000000;
+    ts.tv_nsec = start % 1000000000;
+
+    while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+        /* void */
+    }
+
+    threads = threads_create();
+    if (threads == NULL) {
+        return cluster_error(fd, "failed to create threads");
+    }
+
+    used = threads_run(threads);
+
+    status = status_collect(threads);
+    if (status == NULL) {
+        return cluster_error(fd, "failed to collect status");
+    }
+
+    len = sizeof(uint64_t) + status_encode_size(status);
+
+    data = zmalloc(len);
+    if (data == NULL) {
+        return cluster_error(fd, "failed to encode status");
+    }
+
+    used = htobe64(used);
+    p = cpymem(data, &used, sizeof(uint64_t));
+    status_encode(status, p);
+
+    return cluster_send(fd, CLUSTER_RESULT, data, len);
+}
+
+
+int
+cluster_coordinate(int argc, char **argv)
+{
+    int i, n, ret, *fds;
+    char *p, *next, *data, *script, *token, **addrs;
+    size_t len, script_size;
+    uint32_t type;
+    uint64_t start, used, worker_used;
+    struct buf *args;
+    struct timeval tv;
+    struct status *status;
+
+    n = 1;
+
+    for (p = cfg.workers; *p != '\0'; p++) {
+        n += (*p == ',');
+    }
+
+    addrs = zcalloc(sizeof(char *) * n);
+    fds = zcalloc(sizeof(int) * n);
+    if (addrs == NULL || fds == NULL) {
+        return -1;
+    }
+
+    p = strdup(cfg.workers);
+
+    for (i = 0; i < n; i++) {
+        next = strchr(p, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+
+        addrs[i] = p;
+        p = next;
+    }
+
+    token = cluster_token();
+    if (token == NULL) {
+        return -1;
+    }
+
+    if (cluster_args(argc, argv, token, &args)) {
+        return -1;
+    }
+
+    script = NULL;
+    script_size = 0;
+
+    if (cfg.script != NULL) {
+        script = cluster_file_read(cfg.script, &script_size);
+        if (script == NULL) {
+            printf("read script %s failed: %s\n", cfg.script, strerror(errno));
+            return -1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        fds[i] = cluster_connect(addrs[i]);
+        if (fds[i] == -1) {
+            return -1;
+        }
+
+        len = args->free - args->start;
+
+        if (cluster_send(fds[i], CLUSTER_CONFIG, args->start, len)
+            || cluster_send(fds[i], CLUSTER_SCRIPT, script, script_size))
+        {
+            printf("worker %s: send failed\n", addrs[i]);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        data = cluster_recv(fds[i], &type, &len);
+
+        if (data == NULL) {
+            printf("worker %s: connection lost\n", addrs[i]);
+            return -1;
+        }
+
+        if (type != CLUSTER_READY) {
+            printf("worker %s: %.*s\n", addrs[i], (int) len, data);
+            return -1;
+        }
+
+        zfree(data);
+    }
+
+    start = htobe64(realtime_time() + CLUSTER_START_DELAY);
+
+    for (i = 0; i < n; i++) {
+        if (cluster_send(fds[i], CLUSTER_START, &start, sizeof(uint64_t))) {
+            printf("worker %s: send failed\n", addrs[i]);
+            return -1;
+        }
+    }
+
+    printf("Testing %d workers x %d threads and %d connections\n"
+           "@ %s for %ds\n",
+           n, cfg.threads, cfg.connections, cfg.url, cfg.duration);
+
+    status = status_create();
+    if (status == NULL) {
+        return -1;
+    }
+
+    tv.tv_sec = cfg.duration + CLUSTER_RESULT_TIMEOUT;
+    tv.tv_usec = 0;
+
+    used = 0;
+    ret = -1;
+
+    for (i = 0; i < n; i++) {
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        data = cluster_recv(fds[i], &type, &len);
+
+        if (data == NULL || type != CLUSTER_RESULT
+            || len < sizeof(uint64_t)
+            || status_decode(status, data + sizeof(uint64_t), data + len))
+        {
+            if (data != NULL && type == CLUSTER_ERROR) {
+                printf("worker %s: %.*s\n", addrs[i], (int) len, data);
+
+            } else {
+                printf("worker %s: no result\n", addrs[i]);
+            }
+
+            continue;
+        }
+
+        memcpy(&worker_used, data, sizeof(uint64_t));
+        used = max_int(used, be64toh(worker_used));
+
+        zfree(data);
+        close(fds[i]);
+
+        ret = 0;
+    }
+
+    if (ret == 0) {
+        status_print(status, used);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Workers receive the token and the command line of the coordinator
+ * without the workers option itself.
+ */
+static int
+cluster_args(int argc, char **argv, char *token, struct buf **out)
+{
+    int i;
+    size_t size;
+    struct buf *b;
+
+    size = strlen(token) + 1;
+
+    for (i = 0; i < argc; i++) {
+        size += strlen(argv[i]) + 1;
+    }
+
+    b = buf_alloc(size);
+    if (b == NULL) {
+        return -1;
+    }
+
+    b->free = cpymem(b->free, token, strlen(token) + 1);
+
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--workers") == 0) {
+            i++;
+            continue;
+        }
+
+        if (strncmp(argv[i], "-w", 2) == 0
+            || strncmp(argv[i], "--workers=", 10) == 0)
+        {
+            continue;
+        }
+
+        b->free = cpymem(b->free, argv[i], strlen(argv[i]) + 1);
+    }
+
+    *out = b;
+
+    return 0;
+}
+
+
+int
+cluster_listen(char *addr)
+{
+    int fd, ret, val;
+    char *host, *port;
+    struct addrinfo *addrs;
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags    = AI_PASSIVE
+    };
+
+    if (cluster_addr(addr, &host, &port)) {
+        printf("Invalid address \"%s\"\n", addr);
+        return -1;
+    }
+
+    /* Other hosts are only served when the address names them. */
+    if (host == NULL) {
+        host = "127.0.0.1";
+    }
+
+    ret = getaddrinfo(host, port, &hints, &addrs);
+    if (ret != 0) {
+        printf("unable to resolve %s: %s\n", addr, gai_strerror(ret));
+        return -1;
+    }
+
+    fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+    if (fd == -1) {
+        goto fail;
+    }
+
+    val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+    if (bind(fd, addrs->ai_addr, addrs->ai_addrlen) == -1
+        || listen(fd, 16) == -1)
+    {
+        close(fd);
+        goto fail;
+    }
+
+    freeaddrinfo(addrs);
+
+    return fd;
+
+fail:
+
+    printf("listen(\"%s\") failed: %s\n", addr, strerror(errno));
+    freeaddrinfo(addrs);
+
+    return -1;
+}
+
+
+static int
+cluster_connect(char *addr)
+{
+    int fd, ret;
+    char *host, *port;
+    struct addrinfo *addrs, *ai;
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+
+    if (cluster_addr(addr, &host, &port) || host == NULL) {
+        printf("Invalid worker address \"%s\"\n", addr);
+        return -1;
+    }
+
+    ret = getaddrinfo(host, port, &hints, &addrs);
+    if (ret != 0) {
+        printf("unable to resolve %s: %s\n", addr, gai_strerror(ret));
+        return -1;
+    }
+
+    fd = -1;
+
+    for (ai = addrs; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addrs);
+
+    if (fd == -1) {
+        printf("connect(\"%s\") failed: %s\n", addr, strerror(errno));
+    }
+
+    return fd;
+}
+
+
+static int
+cluster_addr(char *addr, char **host, char **port)
+{
+    char *p;
+
+    p = strrchr(addr, ':');
+
+    if (p == NULL) {
+        *host = NULL;
+        *port = addr;
+
+    } else {
+        *host = strndup(addr, p - addr);
+        *port = p + 1;
+    }
+
+    return (**port == '\0') ? -1 : 0;
+}
+
+
+static int
+cluster_send(int fd, uint32_t type, void *data, size_t len)
+{
+    uint32_t header[2];
+
+    header[0] = htonl(type);
+    header[1] = htonl(len);
+
+    if (cluster_write(fd, header, sizeof(header))) {
+        return -1;
+    }
+
+    return cluster_write(fd, data, len);
+}
+
+
+static int
+cluster_write(int fd, void *buf, size_t size)
+{
+    char *p;
+    ssize_t n;
+
+    p = buf;
+
+    while (size > 0) {
+        n = write(fd, p, size);
+
+        if (n > 0) {
+            p += n;
+            size -= n;
+            continue;
+        }
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+cluster_read(int fd, void *buf, size_t size)
+{
+    char *p;
+    ssize_t n;
+
+    p = buf;
+
+    while (size > 0) {
+        n = read(fd, p, size);
+
+        if (n > 0) {
+            p += n;
+            size -= n;
+            continue;
+        }
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static char *
+cluster_recv(int fd, uint32_t *type, size_t *len)
+{
+    char *data;
+    uint32_t header[2];
+
+    if (cluster_read(fd, header, sizeof(header))) {
+        return NULL;
+    }
+
+    *type = ntohl(header[0]);
+    *len = ntohl(header[1]);
+
+    if (*len > CLUSTER_MAX_MESSAGE) {
+        return NULL;
+    }
+
+    data = zmalloc(*len + 1);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    if (cluster_read(fd, data, *len)) {
+        zfree(data);
+        return NULL;
+    }
+
+    data[*len] = '\0';
+
+    return data;
+}
+
+
+static int
+cluster_error(int fd, char *msg)
+{
+    (void) cluster_send(fd, CLUSTER_ERROR, msg, strlen(msg));
+    return -1;
+}
+
+
+static char *
+cluster_file_read(char *path, size_t *size)
+{
+    int fd;
+    char *data;
+    struct stat st;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    data = NULL;
+    *size = 0;
+
+    if (fstat(fd, &st) == 0) {
+        data = zmalloc(st.st_size + 1);
+
+        if (data != NULL && cluster_read(fd, data, st.st_size)) {
+            zfree(data);
+            data = NULL;
+        }
+
+        if (data != NULL) {
+            *size = st.st_size;
+        }
+    }
+
+    close(fd);
+
+    return data;
+}
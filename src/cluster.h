@@ -0,0 +1,11 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+int cluster_worker(void);
+int cluster_coordinate(int argc, char **argv);
+int cluster_listen(char *addr);
+
+#endif /* CLUSTER_H */
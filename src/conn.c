@@ -5,27 +5,61 @@
 
 static int unix_connected(struct conn *, char *);
 static ssize_t unix_recv(struct conn *, void *, size_t);
+static ssize_t unix_recv_stamped(struct conn *, void *, size_t);
+static uint64_t unix_cmsg_time(struct msghdr *);
 static ssize_t unix_send(struct conn *, void *, size_t);
+static ssize_t unix_send_file(struct conn *, int, off_t *, size_t);
 static void unix_close(struct conn *);
+static void conn_sockopts_apply(int);
+
+/*
+ * The socket options of the command line, set on every socket when
+ * the value is not -1.  The quick ack mode does not stick, it is set
+ * again after every read.
+ */
+struct sockopt {
+    char *name;
+    char *kernel;
+    int level;
+    int option;
+    int value;
+};
+
+static struct sockopt conn_sockopts[] = {
+    { "busy-poll",     "SO_BUSY_POLL",      SOL_SOCKET,  SO_BUSY_POLL,      -1 },
+    { "quickack",      "TCP_QUICKACK",      IPPROTO_TCP, TCP_QUICKACK,      -1 },
+    { "rcvbuf",        "SO_RCVBUF",         SOL_SOCKET,  SO_RCVBUF,         -1 },
+    { "sndbuf",        "SO_SNDBUF",         SOL_SOCKET,  SO_SNDBUF,         -1 },
+    { "notsent-lowat", "TCP_NOTSENT_LOWAT", IPPROTO_TCP, TCP_NOTSENT_LOWAT, -1 },
+    { "incoming-cpu",  "SO_INCOMING_CPU",   SOL_SOCKET,  SO_INCOMING_CPU,   -1 },
+};
+
+static int conn_sockopts_set;
+static int conn_quickack;
 
 conn_io unix_conn_io = {
     .connected = unix_connected,
     .recv = unix_recv,
     .send = unix_send,
+    .send_file = unix_send_file,
     .close = unix_close,
 };
 
 
-void
+int
 conn_connect(struct conn *c, struct addrinfo *addr)
 {
     struct thread *thr = cur_thread();
     event_engine *engine = thr->engine;
     int fd, flags;
+    struct linger linger;
+
+    c->socket.fd = -1;
 
     fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
     if (fd == -1) {
-        return;
+        engine->status->connect_errors++;
+        return ERROR;
     }
 
     c->socket.fd = fd;
@@ -36,22 +70,66 @@ conn_connect(struct conn *c, struct addrinfo *addr)
     flags = 1;
     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
 
+    if (conn_sockopts_set) {
+        conn_sockopts_apply(fd);
+    }
+
+    /* A reset instead of a FIN leaves no TIME_WAIT behind. */
+    if (cfg.linger) {
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+
+    /*
+     * The kernel stamps every packet sent and received, the send times
+     * come back on the error queue without the data.
+     */
+    if (cfg.timestamping) {
+        flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE
+                | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+        setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    }
+
+    /*
+     * With Fast Open, connect() returns at once and the first write
+     * sends the SYN, with the data if a cookie of the server is cached.
+     */
+    if (cfg.fastopen) {
+        flags = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &flags,
+                       sizeof(flags)) == 0)
+        {
+            engine->status->fastopen_connects++;
+        }
+    }
+
     if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
         if (errno != EINPROGRESS) {
             goto error;
         }
     }
 
+    /*
+     * Both events are registered once, edge triggered.  A request is
+     * written at once and a write event is only waited for when the
+     * socket buffer is full.
+     */
+    c->sending = 0;
+
     flags = EVENT_READ | EVENT_WRITE;
     if (epoll_add_event(engine, &c->socket, flags)) {
         goto error;
     }
 
-    return;
+    return OK;
 
 error:
     engine->status->connect_errors++;
     close(fd);
+    c->socket.fd = -1;
+
+    return ERROR;
 }
 
 
@@ -62,9 +140,19 @@ conn_connected(struct conn *c, char *host)
     event_engine *engine = thr->engine;
     int ret;
 
+    /* The error of a failed connect also comes as a write event. */
+    if (c->socket.fd == -1) {
+        return;
+    }
+
     ret = c->io->connected(c, host);
 
     if (ret == OK) {
+        engine->status->connects++;
+        engine->status->active++;
+        c->connected = 1;
+        c->retries = 0;
+        c->connect_time = (thr->time - c->start) / 1000;
         c->socket.write_handler = conn_write;
         c->socket.read_handler = conn_read;
         c->read_handler(c, NULL);
@@ -73,11 +161,68 @@ conn_connected(struct conn *c, char *host)
 
     if (ret != RETRY) {
         engine->status->connect_errors++;
-        return;
+        c->error_handler(c, NULL);
     }
 }
 
 
+/*
+ * A connection reads into a buffer of the thread pool.  It keeps the
+ * buffer for its lifetime, or in lean mode only while a response is
+ * being read.
+ */
+
+int
+conn_buf_attach(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+    struct conn_buf *cb;
+    struct buf *b;
+
+    b = thr->read_bufs;
+
+    if (b != NULL) {
+        thr->read_bufs = b->next;
+        b->next = NULL;
+
+        cb = container_of(b, struct conn_buf, buf);
+
+    } else {
+        cb = zcalloc(sizeof(struct conn_buf) + cfg.read_size);
+        if (cb == NULL) {
+            return ERROR;
+        }
+
+        b = &cb->buf;
+        b->start = (char *) (cb + 1);
+        b->end = b->start + cfg.read_size;
+    }
+
+    b->pos = b->start;
+    b->free = b->start;
+
+    c->read = b;
+    c->parser = &cb->parser;
+    c->chunk_parser = &cb->chunk_parser;
+
+    return OK;
+}
+
+
+void
+conn_buf_detach(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+
+    c->read->next = thr->read_bufs;
+    thr->read_bufs = c->read;
+
+    c->read = NULL;
+    c->parser = NULL;
+    c->chunk_parser = NULL;
+}
+
+
 void
 conn_read(void *obj, void *data)
 {
@@ -87,12 +232,24 @@ conn_read(void *obj, void *data)
     size_t size;
     ssize_t n;
 
+    if (c->read == NULL && conn_buf_attach(c) != OK) {
+        engine->status->read_errors++;
+        c->error_handler(c, NULL);
+        return;
+    }
+
     size = c->read->end - c->read->free;
     n = c->io->recv(c, c->read->free, size);
 
     if (n > 0) {
+        if (conn_quickack) {
+            setsockopt(c->socket.fd, IPPROTO_TCP, TCP_QUICKACK,
+                       &conn_quickack, sizeof(int));
+        }
+
         c->read->free += n;
         engine->status->bytes += n;
+        c->received += n;
         c->read_handler(c, NULL);
         return;
     }
@@ -117,6 +274,13 @@ conn_write(void *obj, void *data)
     struct conn *c = obj;
     size_t size;
     ssize_t n;
+    uint8_t sent;
+
+    if (!c->sending) {
+        return;
+    }
+
+    sent = 0;
 
     while (c->write->pos < c->write->free) {
         size = c->write->free - c->write->pos;
@@ -124,20 +288,186 @@ conn_write(void *obj, void *data)
 
         if (n > 0) {
             c->write->pos += n;
+            sent = 1;
             continue;
         }
 
-        if (n != RETRY) {
-            engine->status->write_errors++;
-            c->error_handler(c, NULL);
-            return;
+        goto failed;
+    }
+
+    while (c->file_offset < c->file_size) {
+        size = min_int(c->file_size - c->file_offset, 0x7ffff000);
+        n = c->io->send_file(c, c->file, &c->file_offset, size);
+
+        if (n > 0) {
+            sent = 1;
+            continue;
         }
 
-        epoll_add_event(thr->engine, &c->socket, EVENT_WRITE);
+        goto failed;
+    }
+
+    /* Precise latency starts when the request is sent completely. */
+    if (cfg.precise && sent) {
+        c->start = precise_time();
+    }
+
+    c->sent = cfg.precise ? c->start : thr->time;
+
+    c->sending = 0;
+    return;
+
+failed:
+
+    if (n != RETRY) {
+        c->sending = 0;
+        engine->status->write_errors++;
+        c->error_handler(c, NULL);
+    }
+}
+
+
+/* A value of NULL enables an option without argument. */
+
+int
+conn_sockopt_set(const char *name, char *value)
+{
+    int i, val;
+
+    val = (value == NULL) ? 1 : parse_int(value, strlen(value));
+    if (val < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < countof(conn_sockopts); i++) {
+        if (strcmp(conn_sockopts[i].name, name) == 0) {
+            conn_sockopts[i].value = val;
+            conn_sockopts_set = 1;
+
+            if (conn_sockopts[i].option == TCP_QUICKACK) {
+                conn_quickack = val;
+            }
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+/* The values applied are read back from the kernel on a probe socket. */
+
+void
+conn_sockopts_report(struct addrinfo *addr)
+{
+    int i, fd, val;
+    socklen_t len;
+    struct sockopt *opt;
+
+    if (!conn_sockopts_set) {
         return;
     }
 
-    epoll_delete_event(thr->engine, &c->socket, EVENT_WRITE);
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd == -1) {
+        return;
+    }
+
+    printf("Socket options:\n");
+
+    for (i = 0; i < countof(conn_sockopts); i++) {
+        opt = &conn_sockopts[i];
+
+        if (opt->value == -1) {
+            continue;
+        }
+
+        if (setsockopt(fd, opt->level, opt->option, &opt->value,
+                       sizeof(int)))
+        {
+            printf("  %-18s %d failed: %s\n", opt->kernel, opt->value,
+                   strerror(errno));
+            continue;
+        }
+
+        len = sizeof(int);
+
+        if (getsockopt(fd, opt->level, opt->option, &val, &len)) {
+            val = -1;
+        }
+
+        printf("  %-18s %d\n", opt->kernel, val);
+    }
+
+    close(fd);
+}
+
+
+static void
+conn_sockopts_apply(int fd)
+{
+    int i;
+    struct sockopt *opt;
+
+    for (i = 0; i < countof(conn_sockopts); i++) {
+        opt = &conn_sockopts[i];
+
+        if (opt->value != -1) {
+            setsockopt(fd, opt->level, opt->option, &opt->value, sizeof(int));
+        }
+    }
+}
+
+
+/* Whether the server acknowledged the data sent in the SYN. */
+
+int
+conn_syn_data(struct conn *c)
+{
+    socklen_t len;
+    struct tcp_info info;
+
+    len = sizeof(struct tcp_info);
+
+    if (getsockopt(c->socket.fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+        return 0;
+    }
+
+    return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+}
+
+
+/*
+ * The send time of the last packet, taken from the error queue.
+ * Returns 0 if the queue holds no time.
+ */
+
+uint64_t
+conn_tx_time(struct conn *c)
+{
+    char control[256];
+    uint64_t time, t;
+    struct msghdr msg;
+
+    time = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(c->socket.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            break;
+        }
+
+        t = unix_cmsg_time(&msg);
+        if (t > time) {
+            time = t;
+        }
+    }
+
+    return time;
 }
 
 
@@ -146,8 +476,14 @@ conn_close(struct conn *c)
 {
     struct thread *thr = cur_thread();
 
+    if (c->connected) {
+        thr->engine->status->active--;
+        c->connected = 0;
+    }
+
     epoll_delete_event(thr->engine, &c->socket, EVENT_WRITE | EVENT_READ);
     close(c->socket.fd);
+    c->socket.fd = -1;
     c->io->close(c);
 }
 
@@ -175,6 +511,10 @@ unix_recv(struct conn *c, void *buf, size_t size)
 {
     ssize_t n;
 
+    if (cfg.timestamping) {
+        return unix_recv_stamped(c, buf, size);
+    }
+
     for (;;) {
         n = read(c->socket.fd, c->read->free, size);
 
@@ -202,6 +542,80 @@ unix_recv(struct conn *c, void *buf, size_t size)
 }
 
 
+static ssize_t
+unix_recv_stamped(struct conn *c, void *buf, size_t size)
+{
+    char control[256];
+    ssize_t n;
+    uint64_t time;
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        n = recvmsg(c->socket.fd, &msg, 0);
+
+        if (n > 0) {
+            time = unix_cmsg_time(&msg);
+            if (time != 0) {
+                c->rx_time = time;
+            }
+
+            if (n < size) {
+                c->socket.read_ready = 0;
+            }
+            return n;
+        }
+
+        if (n == 0) {
+            return 0;
+        }
+
+        switch (errno) {
+        case EAGAIN:
+            c->socket.read_ready = 0;
+            return RETRY;
+        case EINTR:
+            continue;
+        default:
+            return ERROR;
+        }
+    }
+}
+
+
+/* The software time of SCM_TIMESTAMPING in ns, or 0. */
+
+static uint64_t
+unix_cmsg_time(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+    struct scm_timestamping *ts;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            ts = (struct scm_timestamping *) CMSG_DATA(cmsg);
+
+            return ts->ts[0].tv_sec * 1000000000ULL + ts->ts[0].tv_nsec;
+        }
+    }
+
+    return 0;
+}
+
+
 static ssize_t
 unix_send(struct conn *c, void *buf, size_t size)
 {
@@ -213,6 +627,33 @@ unix_send(struct conn *c, void *buf, size_t size)
             return n;
         }
 
+        switch (errno) {
+        case EAGAIN: return RETRY;
+        /* A Fast Open SYN without data, the write follows the handshake. */
+        case EINPROGRESS: return RETRY;
+        case EINTR: continue;
+        default: return ERROR;
+        }
+    }
+}
+
+
+static ssize_t
+unix_send_file(struct conn *c, int fd, off_t *offset, size_t size)
+{
+    ssize_t n;
+
+    for (;;) {
+        n = sendfile(c->socket.fd, fd, offset, size);
+        if (n > 0) {
+            return n;
+        }
+
+        /* The file is shorter than expected. */
+        if (n == 0) {
+            return ERROR;
+        }
+
         switch (errno) {
         case EAGAIN: return RETRY;
         case EINTR: continue;
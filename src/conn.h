@@ -10,29 +10,75 @@ typedef struct {
     int (*connected)(struct conn *, char *host);
     ssize_t (*recv)(struct conn *, void *, size_t);
     ssize_t (*send)(struct conn *, void *, size_t);
+    ssize_t (*send_file)(struct conn *, int, off_t *, size_t);
     void (*close)(struct conn *);
 } conn_io;
 
-struct conn {
-    file_event socket;
+/* A read buffer with the state of the response read into it. */
+struct conn_buf {
     http_parser parser;
     http_chunk_parser chunk_parser;
+    struct buf buf;
+};
+
+/* The fields are ordered to leave no padding. */
+struct conn {
+    file_event socket;
+    struct timer timer;
     uint64_t start;
+    /*
+     * The times the request was sent, the response began and its header
+     * ended, and the bytes read of the response.
+     */
+    uint64_t sent;
+    uint64_t first;
+    uint64_t header;
+    uint64_t received;
+    /* The kernel receive time of the last read, in realtime ns. */
+    uint64_t rx_time;
+    off_t remainder;
     struct buf *read;
+    /* The next connection handed to the same thread. */
+    struct conn *next;
     struct buf *write;
-    struct timer timer;
-    off_t remainder;
+    http_parser *parser;
+    http_chunk_parser *chunk_parser;
     void *ssl;
     const conn_io *io;
     event_handler read_handler;
     event_handler close_handler;
     event_handler error_handler;
+    /* The tag of the current request and the values of its group fields. */
+    struct status_group_value *tag;
+    struct status_group_value *groups[HTTP_PARSE_GROUPS];
+    /* The request body sent from a file after the write buffer. */
+    off_t file_offset;
+    off_t file_size;
+    int file;
+    /* The number of the connection in the run. */
+    uint32_t id;
+    uint32_t header_size;
+    uint32_t requests;
+    /* The time in us the last connect took. */
+    uint32_t connect_time;
+    uint8_t body_truncated;
+    /* A request is being sent, write events are ignored otherwise. */
+    uint8_t sending;
+    uint8_t connected;
+    /* The connect attempts failed in a row. */
+    uint8_t retries;
 };
 
-void conn_connect(struct conn *, struct addrinfo *);
+int conn_connect(struct conn *, struct addrinfo *);
 void conn_connected(struct conn *, char *);
+int conn_buf_attach(struct conn *);
+void conn_buf_detach(struct conn *);
 void conn_read(void *, void *);
 void conn_write(void *, void *);
+int conn_sockopt_set(const char *, char *);
+void conn_sockopts_report(struct addrinfo *);
+int conn_syn_data(struct conn *);
+uint64_t conn_tx_time(struct conn *);
 void conn_close(struct conn *);
 
 extern conn_io unix_conn_io;
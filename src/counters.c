@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#include "headers.h"
+
+static int counters_event_open(struct perf_event_attr *, pid_t);
+
+/*
+ * The counters of a worker, opened for its thread or process and read
+ * once the test is over.  Each event is opened on its own so that the
+ * software ones remain when the hardware ones are not available.
+ */
+static struct {
+    uint32_t type;
+    uint64_t config;
+} counters_events[COUNTERS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+
+void
+counters_open(struct thread *t, pid_t pid)
+{
+    int i, fd;
+    struct perf_event_attr attr;
+
+    for (i = 0; i < COUNTERS; i++) {
+        memzero(&attr, sizeof(struct perf_event_attr));
+
+        attr.size = sizeof(struct perf_event_attr);
+        attr.type = counters_events[i].type;
+        attr.config = counters_events[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                           | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        fd = counters_event_open(&attr, pid);
+
+        /* Unprivileged users may only count in user space. */
+
+        if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = counters_event_open(&attr, pid);
+        }
+
+        if (fd != -1) {
+            t->counters[i] = fd;
+            t->counters_mask |= 1 << i;
+        }
+    }
+}
+
+
+/* The values are scaled up when the kernel multiplexed the events. */
+
+void
+counters_read(struct thread *t)
+{
+    int i;
+    struct status *status = t->status;
+    struct {
+        uint64_t value;
+        uint64_t enabled;
+        uint64_t running;
+    } val;
+
+    for (i = 0; i < COUNTERS; i++) {
+        if (!(t->counters_mask & (1 << i))) {
+            continue;
+        }
+
+        if (read(t->counters[i], &val, sizeof(val)) == sizeof(val)) {
+            if (val.running > 0 && val.running < val.enabled) {
+                val.value = (double) val.value * val.enabled / val.running;
+            }
+
+            status->counters[i] = val.value;
+            status->counters_mask |= 1 << i;
+        }
+
+        close(t->counters[i]);
+    }
+
+    t->counters_mask = 0;
+}
+
+
+void
+counters_rusage(struct status *status, struct rusage *ru)
+{
+    status->counters[COUNTER_CPU_TIME] =
+        (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000ULL
+        + (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000ULL;
+
+    status->counters[COUNTER_SWITCHES] = ru->ru_nvcsw + ru->ru_nivcsw;
+    status->counters[COUNTER_FAULTS] = ru->ru_minflt + ru->ru_majflt;
+
+    status->counters_mask |= (1 << COUNTER_CPU_TIME) | (1 << COUNTER_SWITCHES)
+                            | (1 << COUNTER_FAULTS);
+}
+
+
+static int
+counters_event_open(struct perf_event_attr *attr, pid_t pid)
+{
+    return syscall(SYS_perf_event_open, attr, pid, -1, -1,
+                   PERF_FLAG_FD_CLOEXEC);
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+enum {
+    COUNTER_CPU_TIME,
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_SWITCHES,
+    COUNTER_FAULTS,
+    COUNTERS,
+};
+
+void counters_open(struct thread *, pid_t);
+void counters_read(struct thread *);
+void counters_rusage(struct status *, struct rusage *);
+
+#endif /* COUNTERS_H */
@@ -105,15 +105,26 @@ epoll_poll(event_engine *engine, int timeout)
     struct epoll *epoll = &engine->epoll;
     int i, nevents;
     struct epoll_event *event;
+    struct status *status = engine->status;
+    uint64_t start;
+
+    /* The loop is busy from the end of a wait to the start of the next. */
+
+    start = monotonic_time();
+    status->loop_busy += start - thr->time;
 
     nevents = epoll_wait(epoll->epfd, epoll->events, epoll->mevents, timeout);
 
     thr->time = monotonic_time();
+    status->loop_wait += thr->time - start;
 
     if (nevents < 0) {
         return;
     }
 
+    status->loop_events += nevents;
+    status->loop_wakeups[status_wakeup_bucket(nevents)]++;
+
     for (i = 0; i < nevents; i++) {
         event = &epoll->events[i];
         file_event *ev = event->data.ptr;
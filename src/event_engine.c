@@ -3,6 +3,8 @@
  */
 #include "headers.h"
 
+static void event_engine_tick(void *, void *);
+
 event_engine *
 event_engine_create(int mevents)
 {
@@ -32,13 +34,36 @@ void
 event_engine_start(event_engine *engine)
 {
     struct thread *thr = cur_thread();
-    int timeout;
+    int timeout, balance;
     uint32_t now;
 
+    engine->tick.handler = event_engine_tick;
+    timer_add(engine, &engine->tick, EVENT_ENGINE_TICK);
+
+    /* Only the worker threads of --rebalance hand connections off. */
+    balance = (thr->balance != NULL);
+
     while (1) {
         timeout = timer_find(engine);
         epoll_poll(engine, timeout);
         now = thr->time / 1000000;
         timer_expire(engine, now);
+
+        if (balance) {
+            balance_flush();
+        }
     }
 }
+
+
+static void
+event_engine_tick(void *obj, void *data)
+{
+    struct thread *thr = cur_thread();
+    struct timer *timer = obj;
+    event_engine *engine = container_of(timer, event_engine, tick);
+
+    status_sample(engine->status, thr->time);
+
+    timer_add(engine, timer, EVENT_ENGINE_TICK);
+}
@@ -8,9 +8,13 @@ struct event_engine {
     struct epoll epoll;
     struct timers timers;
     struct status *status;
+    /* Keeps the loop lag measured when no other timer expires. */
+    struct timer tick;
 };
 
 event_engine *event_engine_create(int mevents);
 void event_engine_start(event_engine *engine);
 
+#define EVENT_ENGINE_TICK  100
+
 #endif /* EVENT_ENGINE_H */
@@ -19,8 +19,15 @@ typedef struct hdr_histogram hdr_histogram;
 #include "conn.h"
 #include "ssl.h"
 #include "http.h"
+#include "balance.h"
 #include "script.h"
+#include "template.h"
+#include "replay.h"
+#include "counters.h"
 #include "status.h"
+#include "metrics.h"
+#include "slow.h"
+#include "cluster.h"
 #include "main.h"
 
 #endif /* HEADERS_H */
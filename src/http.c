@@ -4,13 +4,25 @@
 #include "headers.h"
 
 static void http_peer_conn_test(void *, void *);
+static void http_peer_connect_timeout(void *, void *);
+static void http_peer_connect_error(void *, void *);
+static void http_peer_backoff(struct conn *);
+static void http_peer_retry(void *, void *);
 static void http_peer_reconnect(struct conn *);
 static void http_peer_init(void *, void *);
+static void http_peer_send(void *, void *);
+static uint32_t http_peer_think_time(struct thread *);
 static void http_peer_header_read(void *, void *);
 static void http_peer_header_parse(void *, void *);
+static int http_peer_read_grow(struct conn *);
+static uint32_t http_peer_read_class(size_t);
+static void http_peer_read_release(struct conn *);
 static void http_peer_process(struct conn *);
 static void http_peer_body_read(void *, void *);
+static void http_peer_body_reset(struct conn *);
 static void http_peer_done(struct conn *);
+static void http_peer_group(struct status_group_value *, int, uint64_t);
+static void http_peer_wire(struct conn *);
 static void http_peer_timeout(void *, void *);
 static void http_peer_close_handler(void *, void *);
 static void http_peer_error_handler(void *, void *);
@@ -40,15 +52,54 @@ http_header_parse(http_field *field, char *header)
 }
 
 
+/*
+ * Failed connects are retried after an exponential backoff from 10ms
+ * to 1s, with jitter so that the connections lost in an overload do not
+ * come back all at once.
+ */
+#define HTTP_BACKOFF_MIN  10
+#define HTTP_BACKOFF_MAX  1000
+
+
 void
 http_peer_connect(struct conn *c)
 {
+    struct thread *thr = cur_thread();
+
     c->socket.read_handler = http_peer_conn_test;
     c->socket.write_handler = http_peer_conn_test;
     c->socket.data = c;
     c->read_handler = http_peer_init;
+    c->error_handler = http_peer_connect_error;
+    c->requests = 0;
+    c->start = thr->time;
+
+    if (conn_connect(c, cfg.addr) != OK) {
+        http_peer_backoff(c);
+        return;
+    }
 
-    conn_connect(c, cfg.addr);
+    /* The handshake of TLS is within the connect timeout too. */
+    c->timer.handler = http_peer_connect_timeout;
+    timer_add(thr->engine, &c->timer, cfg.connect_timeout);
+}
+
+
+/* A connection moved from another thread goes on with a new request. */
+
+void
+http_peer_adopt(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+
+    thr->engine->status->active++;
+
+    if (epoll_add_event(thr->engine, &c->socket, EVENT_READ | EVENT_WRITE)) {
+        http_peer_reconnect(c);
+        return;
+    }
+
+    http_peer_init(c, NULL);
 }
 
 
@@ -60,9 +111,73 @@ http_peer_conn_test(void *obj, void *data)
 }
 
 
+static void
+http_peer_connect_timeout(void *obj, void *data)
+{
+    struct thread *thr = cur_thread();
+    struct timer *timer = obj;
+    struct conn *c = container_of(timer, struct conn, timer);
+
+    thr->engine->status->connect_errors++;
+
+    conn_close(c);
+    http_peer_backoff(c);
+}
+
+
+static void
+http_peer_connect_error(void *obj, void *data)
+{
+    struct thread *thr = cur_thread();
+    struct conn *c = obj;
+
+    if (timer_is_in_tree(&c->timer)) {
+        timer_remove(thr->engine, &c->timer);
+    }
+
+    conn_close(c);
+    http_peer_backoff(c);
+}
+
+
+static void
+http_peer_backoff(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+    uint32_t delay;
+
+    delay = min_int(HTTP_BACKOFF_MIN << min_int(c->retries, 7),
+                    HTTP_BACKOFF_MAX);
+    delay = delay / 2 + random_next(&thr->random) % (delay / 2 + 1);
+
+    if (c->retries < 255) {
+        c->retries++;
+    }
+
+    c->timer.handler = http_peer_retry;
+    timer_add(thr->engine, &c->timer, delay);
+}
+
+
+static void
+http_peer_retry(void *obj, void *data)
+{
+    struct timer *timer = obj;
+    struct conn *c = container_of(timer, struct conn, timer);
+
+    http_peer_connect(c);
+}
+
+
 static void
 http_peer_reconnect(struct conn *c)
 {
+    struct thread *thr = cur_thread();
+
+    if (timer_is_in_tree(&c->timer)) {
+        timer_remove(thr->engine, &c->timer);
+    }
+
     conn_close(c);
     http_peer_connect(c);
 }
@@ -75,21 +190,42 @@ http_peer_init(void *obj, void *data)
     event_engine *engine = thr->engine;
     struct conn *c = obj;
     struct buf *request;
+    int64_t delay;
+
+    if (c->read != NULL) {
+        if (c->read->next != NULL) {
+            http_peer_read_release(c);
+        }
+
+        if (cfg.lean) {
+            conn_buf_detach(c);
+
+        } else {
+            c->read->free = c->read->start;
+            c->read->pos = c->read->start;
+        }
+    }
 
-    c->read->free = c->read->start;
-    c->read->pos = c->read->start;
     c->read_handler = http_peer_header_read;
     c->close_handler = http_peer_close_handler;
     c->error_handler = http_peer_error_handler;
-    c->timer.handler = http_peer_timeout;
+    c->tag = NULL;
+    c->sent = 0;
+    c->first = 0;
+    c->header = 0;
+    c->received = 0;
 
-    c->start = thr->time;
-    timer_add(engine, &c->timer, cfg.timeout / 1000);
+    delay = -1;
 
     if (thr->has_request) {
         lua_getglobal(thr->lua, "http");
         lua_getfield(thr->lua, -1, "request");
-        lua_call(thr->lua, 0, 1);
+        script_call(thr->lua, 0, 1);
+
+        delay = script_delay(thr->lua);
+
+        c->tag = script_tag(thr->lua, &engine->status->tags);
+
         request = script_request(thr->lua);
         lua_pop(thr->lua, 2);
 
@@ -98,22 +234,86 @@ http_peer_init(void *obj, void *data)
         }
         c->write = request;
 
+    } else if (cfg.replay != NULL) {
+        replay_next(&thr->replay, c->write);
+
+    } else if (thr->template != NULL) {
+        template_render(thr->template, c->write);
+
     } else {
         c->write->pos = c->write->start;
     }
 
-    epoll_add_event(engine, &c->socket, EVENT_WRITE);
+    if (cfg.body_file != NULL) {
+        c->file = cfg.body_fd;
+        c->file_offset = 0;
+        c->file_size = cfg.body_size;
+    }
+
+    /* A delay set by the script, even of 0, replaces the think time. */
+
+    if (delay == -1) {
+        delay = (cfg.think.max > 0) ? http_peer_think_time(thr) : 0;
+    }
+
+    if (delay > 0) {
+        c->timer.handler = http_peer_send;
+        timer_add(engine, &c->timer, (uint32_t) delay);
+        return;
+    }
+
+    http_peer_send(&c->timer, NULL);
+}
+
+
+static void
+http_peer_send(void *obj, void *data)
+{
+    struct thread *thr = cur_thread();
+    event_engine *engine = thr->engine;
+    struct timer *timer = obj;
+    struct conn *c = container_of(timer, struct conn, timer);
+
+    c->timer.handler = http_peer_timeout;
+
+    c->start = request_time(thr);
+    timer_add(engine, &c->timer, cfg.timeout / 1000);
+
+    c->sending = 1;
+    conn_write(c, NULL);
+}
+
+
+static uint32_t
+http_peer_think_time(struct thread *thr)
+{
+    double u;
+    uint32_t delay;
+    struct think *think = &cfg.think;
+
+    u = random_double(&thr->random);
+
+    if (think->exponential) {
+        delay = -log(1 - u) * think->min;
+        return min_int(delay, think->max);
+    }
+
+    return think->min + u * (think->max - think->min);
 }
 
 
 static void
 http_peer_header_read(void *obj, void *data)
 {
+    struct thread *thr = cur_thread();
     struct conn *c = obj;
 
-    memset(&c->parser, 0, sizeof(c->parser));
-    memset(&c->chunk_parser, 0, sizeof(c->chunk_parser));
-    http_parse_init(&c->parser);
+    c->first = request_time(thr);
+
+    memset(c->parser, 0, sizeof(http_parser));
+    memset(c->chunk_parser, 0, sizeof(http_chunk_parser));
+    c->body_truncated = 0;
+    http_parse_init(c->parser);
     http_peer_header_parse(c, NULL);
 }
 
@@ -126,10 +326,12 @@ http_peer_header_parse(void *obj, void *data)
     struct conn *c = obj;
     int ret;
 
-    ret = http_parse_response(&c->parser, c->read);
+    ret = http_parse_response(c->parser, c->read);
 
     switch (ret) {
     case DONE:
+        c->header = request_time(thr);
+        c->header_size = c->read->pos - c->read->start;
         http_peer_process(c);
         return;
 
@@ -138,6 +340,15 @@ http_peer_header_parse(void *obj, void *data)
             c->read_handler = http_peer_header_parse;
             return;
         }
+
+        if (http_peer_read_grow(c) == OK) {
+            c->read_handler = http_peer_header_parse;
+
+            if (c->socket.read_ready) {
+                conn_read(c, NULL);
+            }
+            return;
+        }
         /* fall through */
     default:
         break;
@@ -148,10 +359,110 @@ http_peer_header_parse(void *obj, void *data)
 }
 
 
+/*
+ * A header that does not fit moves to a buffer twice as large from
+ * the pool of the thread, up to the maximum.  A grown buffer links to
+ * the buffer of the connection, which is restored for the next request.
+ */
+
+static int
+http_peer_read_grow(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+    size_t size;
+    struct buf *b, *old;
+    uint32_t i;
+
+    old = c->read;
+    size = old->end - old->start;
+
+    if (size >= cfg.read_max) {
+        return ERROR;
+    }
+
+    size = min_int(size * 2, cfg.read_max);
+    i = http_peer_read_class(size);
+
+    b = thr->read_pool[i];
+
+    if (b != NULL) {
+        thr->read_pool[i] = b->next;
+
+    } else {
+        b = buf_alloc(size);
+        if (b == NULL) {
+            return ERROR;
+        }
+    }
+
+    b->free = cpymem(b->start, old->start, old->free - old->start);
+    b->pos = b->start + (old->pos - old->start);
+
+    http_parse_move(c->parser, old->start, b->start);
+
+    if (old->next != NULL) {
+        b->next = old->next;
+        http_peer_read_release(c);
+
+    } else {
+        b->next = old;
+    }
+
+    c->read = b;
+
+    thr->engine->status->read_grows++;
+
+    return OK;
+}
+
+
+static uint32_t
+http_peer_read_class(size_t size)
+{
+    size_t n;
+    uint32_t i;
+
+    i = 0;
+
+    for (n = cfg.read_size * 2; n < size && n < cfg.read_max; n *= 2) {
+        i++;
+    }
+
+    return i;
+}
+
+
+static void
+http_peer_read_release(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+    struct buf *b;
+    uint32_t i;
+
+    b = c->read;
+    c->read = b->next;
+
+    i = http_peer_read_class(b->end - b->start);
+
+    b->next = thr->read_pool[i];
+    thr->read_pool[i] = b;
+}
+
+
 static void
 http_peer_process(struct conn *c)
 {
-    http_parser *parser = &c->parser;
+    struct thread *thr = cur_thread();
+    http_parser *parser = c->parser;
+    int i;
+
+    /* The values are taken before the body can overwrite the header. */
+
+    for (i = 0; i < cfg.ngroups; i++) {
+        c->groups[i] = status_group_find(&thr->engine->status->groups[i],
+                                         parser->group_values[i],
+                                         parser->group_lengths[i]);
+    }
 
     if (parser->content_length_n <= 0 && !parser->chunked) {
         http_peer_done(c);
@@ -166,8 +477,7 @@ http_peer_process(struct conn *c)
     } else {
         c->read_handler = http_peer_body_read;
 
-        c->read->free = c->read->start;
-        c->read->pos = c->read->start;
+        http_peer_body_reset(c);
 
         if (c->socket.read_ready) {
             conn_read(c, NULL);
@@ -186,11 +496,11 @@ http_peer_body_read(void *obj, void *data)
     struct buf *b, *out, *next;
     size_t size;
 
-    parser = &c->parser;
+    parser = c->parser;
 
     if (parser->chunked) {
-        out = http_parse_chunk(&c->chunk_parser, c->read);
-        if (c->chunk_parser.chunk_error || c->chunk_parser.error) {
+        out = http_parse_chunk(c->chunk_parser, c->read);
+        if (c->chunk_parser->chunk_error || c->chunk_parser->error) {
             goto error;
         }
 
@@ -199,7 +509,7 @@ http_peer_body_read(void *obj, void *data)
             zfree(b);
         }
 
-        if (c->chunk_parser.last) {
+        if (c->chunk_parser->last) {
             c->remainder = 0;
         }
 
@@ -213,8 +523,7 @@ http_peer_body_read(void *obj, void *data)
 
     if (c->remainder > 0) {
         c->read_handler = http_peer_body_read;
-        c->read->free = c->read->start;
-        c->read->pos = c->read->start;
+        http_peer_body_reset(c);
 
         if (c->socket.read_ready) {
             conn_read(c, NULL);
@@ -231,25 +540,117 @@ error:
 }
 
 
+static void
+http_peer_body_reset(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+    char *body;
+
+    /*
+     * The response hook sees the headers and the body in place, so
+     * they are kept as long as the body fits in the read buffer.  The
+     * headers that fill it move to a larger one, and are only dropped
+     * past the maximum.
+     */
+
+    if (thr->has_response) {
+        if (c->read->free < c->read->end) {
+            return;
+        }
+
+        c->body_truncated = 1;
+
+        body = c->read->start + c->header_size;
+
+        if (body >= c->read->end && http_peer_read_grow(c) == OK) {
+            body = c->read->start + c->header_size;
+        }
+
+        if (body < c->read->end) {
+            c->read->free = body;
+            c->read->pos = body;
+            return;
+        }
+
+        c->header_size = 0;
+    }
+
+    c->read->free = c->read->start;
+    c->read->pos = c->read->start;
+}
+
+
 static void
 http_peer_done(struct conn *c)
 {
     struct thread *thr = cur_thread();
     event_engine *engine = thr->engine;
     struct status *status = engine->status;;
-    uint64_t elapsed_us;
+    int i, class;
+    uint64_t elapsed;
     http_parser *parser;
 
-    parser = &c->parser;
+    parser = c->parser;
 
-    elapsed_us = (thr->time - c->start) / 1000;
-    if (elapsed_us <= cfg.timeout) {
-        hdr_record_value(status->latency, elapsed_us);
+    elapsed = request_time(thr) - c->start;
+
+    if (parser->status < STATUS_CODES) {
+        status->codes[parser->status]++;
+    }
+
+    class = parser->status / 100;
+
+    if (elapsed <= cfg.timeout * 1000LL) {
+        if (class >= 1 && class <= STATUS_CLASSES) {
+            hdr_record_value(status->class_latency[class - 1], elapsed);
+        }
+
+        if (class == 2 || !cfg.only_2xx) {
+            hdr_record_value(status->latency, elapsed);
+
+            if (thr->metrics != NULL) {
+                metrics_record(thr->metrics, elapsed);
+            }
+        }
+    }
+
+    if (c->tag != NULL) {
+        http_peer_group(c->tag, class, elapsed);
+    }
+
+    if (thr->slow != NULL) {
+        slow_record(thr->slow, c, elapsed);
+    }
+
+    for (i = 0; i < cfg.ngroups; i++) {
+        if (c->groups[i] != NULL) {
+            http_peer_group(c->groups[i], class, elapsed);
+        }
+    }
+
+    if (cfg.timestamping) {
+        http_peer_wire(c);
     }
 
     timer_remove(engine, &c->timer);
 
-    if (parser->keepalive) {
+    if (thr->has_response) {
+        script_response(thr->lua, c);
+    }
+
+    if (cfg.fastopen && c->requests == 0 && conn_syn_data(c)) {
+        status->fastopen_accepted++;
+    }
+
+    c->requests++;
+
+    if (parser->keepalive
+        && (cfg.conn_requests == 0 || c->requests < cfg.conn_requests))
+    {
+        if (cfg.rebalance && balance_handoff(c)) {
+            return;
+        }
+
         http_peer_init(c, NULL);
     } else {
         http_peer_reconnect(c);
@@ -257,6 +658,42 @@ http_peer_done(struct conn *c)
 }
 
 
+/* A tag or the value of a group field counts like the totals. */
+
+static void
+http_peer_group(struct status_group_value *v, int class, uint64_t elapsed)
+{
+    if (class != 2) {
+        v->errors++;
+    }
+
+    if (elapsed <= cfg.timeout * 1000LL && (class == 2 || !cfg.only_2xx)) {
+        hdr_record_value(v->latency, elapsed);
+    }
+}
+
+
+/*
+ * The wire latency goes from the send of the last request packet to
+ * the receipt of the last response packet, both stamped by the kernel.
+ */
+
+static void
+http_peer_wire(struct conn *c)
+{
+    struct thread *thr = cur_thread();
+    struct status *status = thr->engine->status;
+    uint64_t tx;
+
+    tx = conn_tx_time(c);
+
+    if (tx != 0 && c->rx_time > tx && c->rx_time - tx <= cfg.timeout * 1000LL)
+    {
+        hdr_record_value(status->wire_latency, c->rx_time - tx);
+    }
+}
+
+
 static void
 http_peer_timeout(void *obj, void *data)
 {
@@ -266,6 +703,15 @@ http_peer_timeout(void *obj, void *data)
     struct conn *c = container_of(timer, struct conn, timer);
 
     engine->status->timeouts++;
+
+    if (c->tag != NULL) {
+        c->tag->errors++;
+    }
+
+    if (thr->slow != NULL) {
+        slow_record(thr->slow, c, request_time(thr) - c->start);
+    }
+
     http_peer_reconnect(c);
 }
 
@@ -14,5 +14,6 @@ typedef struct http_field {
 
 int http_header_parse(http_field *field, char *header);
 void http_peer_connect(struct conn *c);
+void http_peer_adopt(struct conn *c);
 
 #endif /* HTTP_H */
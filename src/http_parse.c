@@ -9,6 +9,7 @@ static int http_parse_field_name(http_parser *, char **, char *);
 static int http_parse_field_value(http_parser *, char **, char *);
 static int http_parse_field_end(http_parser *, char **, char *);
 static char *http_parse_field_lookup_end(char *, char *);
+static int http_parse_field_add(char *, int (*)(http_parser *), int);
 static int http_parse_field_proc(http_parser *);
 static int http_parse_field_connection(http_parser *);
 static int http_parse_field_transfer_encoding(http_parser *);
@@ -18,6 +19,94 @@ static int http_parse_field_content_length(http_parser *);
 #define HTTP_MAX_FIELD_VALUE        0x7FFFFFFF
 #define HTTP_FIELD_LVLHSH_SHIFT     5
 
+/*
+ * The fields of interest are looked up by the hash of their name in a
+ * table of open addressing, a field either has a handler or captures
+ * its value for a group.
+ */
+#define HTTP_FIELDS                 16
+
+typedef struct {
+    char *name;
+    uint32_t length;
+    uint32_t hash;
+    int (*handler)(http_parser *);
+    int group;
+} http_field_proc;
+
+static http_field_proc http_fields[HTTP_FIELDS];
+
+
+int
+http_parse_fields_init(char **groups, int n)
+{
+    int i;
+
+    memset(http_fields, 0, sizeof(http_fields));
+
+    if (http_parse_field_add("Connection", http_parse_field_connection, -1)
+        || http_parse_field_add("Transfer-Encoding",
+                                http_parse_field_transfer_encoding, -1)
+        || http_parse_field_add("Content-Length",
+                                http_parse_field_content_length, -1))
+    {
+        return ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (http_parse_field_add(groups[i], NULL, i)) {
+            return ERROR;
+        }
+    }
+
+    return OK;
+}
+
+
+static int
+http_parse_field_add(char *name, int (*handler)(http_parser *), int group)
+{
+    u_char c;
+    uint32_t i, hash, length;
+    http_field_proc *f;
+
+    hash = HTTP_FIELD_HASH_INIT;
+
+    for (length = 0; name[length] != '\0'; length++) {
+        c = name[length];
+
+        if (c <= ' ' || c >= 0x7f || c == ':') {
+            return ERROR;
+        }
+
+        hash = http_field_hash_char(hash, lowcase(c));
+    }
+
+    if (length == 0 || length > HTTP_MAX_FIELD_NAME) {
+        return ERROR;
+    }
+
+    for (i = hash; ; i++) {
+        f = &http_fields[i % HTTP_FIELDS];
+
+        if (f->name == NULL) {
+            break;
+        }
+
+        if (f->length == length && memcasecmp(f->name, name, length) == 0) {
+            return ERROR;
+        }
+    }
+
+    f->name = name;
+    f->length = length;
+    f->hash = hash;
+    f->handler = handler;
+    f->group = group;
+
+    return OK;
+}
+
 
 void
 http_parse_init(http_parser *pr)
@@ -27,6 +116,32 @@ http_parse_init(http_parser *pr)
 }
 
 
+/*
+ * The buffer has moved, the field being parsed and the values of the
+ * group fields seen move with it.
+ */
+
+void
+http_parse_move(http_parser *pr, char *from, char *to)
+{
+    int i;
+
+    for (i = 0; i < HTTP_PARSE_GROUPS; i++) {
+        if (pr->group_values[i] != NULL) {
+            pr->group_values[i] = to + (pr->group_values[i] - from);
+        }
+    }
+
+    if (pr->name != NULL) {
+        pr->name = to + (pr->name - from);
+    }
+
+    if (pr->value != NULL) {
+        pr->value = to + (pr->value - from);
+    }
+}
+
+
 int
 http_parse_response(http_parser *pr, struct buf *b)
 {
@@ -388,18 +503,31 @@ http_parse_field_lookup_end(char *p, char *end)
 static int
 http_parse_field_proc(http_parser *pr)
 {
-    if (memcmp(pr->name, "Connection", pr->name_length) == 0) {
-        return http_parse_field_connection(pr);
-    }
+    uint32_t i;
+    http_field_proc *f;
+
+    for (i = pr->field_hash; ; i++) {
+        f = &http_fields[i % HTTP_FIELDS];
+
+        if (f->name == NULL) {
+            return OK;
+        }
 
-    if (memcmp(pr->name, "Transfer-Encoding", pr->name_length) == 0) {
-        return http_parse_field_transfer_encoding(pr);
+        if (f->hash == pr->field_hash
+            && f->length == pr->name_length
+            && memcasecmp(f->name, pr->name, f->length) == 0)
+        {
+            break;
+        }
     }
 
-    if (memcmp(pr->name, "Content-Length", pr->name_length) == 0) {
-        return http_parse_field_content_length(pr);
+    if (f->handler != NULL) {
+        return f->handler(pr);
     }
 
+    pr->group_values[f->group] = pr->value;
+    pr->group_lengths[f->group] = pr->value_length;
+
     return OK;
 }
 
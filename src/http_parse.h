@@ -5,6 +5,9 @@
 #ifndef HTTP_PARSE_H
 #define HTTP_PARSE_H
 
+/* The response fields whose values group the latency. */
+#define HTTP_PARSE_GROUPS  4
+
 typedef struct http_parser {
     int (*handler)(struct http_parser *, char **, char *);
 
@@ -19,6 +22,8 @@ typedef struct http_parser {
     uint8_t chunked;
     uint8_t skip_field;
     uint8_t discard_unsafe_fields;
+    char *group_values[HTTP_PARSE_GROUPS];
+    uint32_t group_lengths[HTTP_PARSE_GROUPS];
 } http_parser;
 
 typedef struct {
@@ -35,7 +40,9 @@ enum {
     HTTP_PARSE_TOO_LARGE_FIELD,
 };
 
+int http_parse_fields_init(char **, int);
 void http_parse_init(http_parser *);
+void http_parse_move(http_parser *, char *, char *);
 int http_parse_response(http_parser *, struct buf *);
 struct buf *http_parse_chunk(http_chunk_parser *, struct buf *);
 
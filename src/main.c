@@ -5,9 +5,16 @@
 
 #define VERSION "0.4.0"
 
-static int config_init(int, char **);
-struct thread *threads_create(void);
+static void print_memory(void);
+static struct thread *processes_create(struct thread *);
+static void process_start(struct thread *, void *);
+static void processes_abort(struct thread *, int);
+static uint64_t processes_run(struct thread *, uint64_t);
 static void *thread_start(void *);
+static void thread_cleanup(void *);
+
+/* The status of a worker process lives in a shared mapping of this size. */
+#define PROCESS_STATUS_SIZE  (64 * 1024 * 1024)
 
 struct config cfg;
 __thread struct thread thread_ctx;
@@ -22,68 +29,353 @@ static void sigint_handler(int sig)
 
 int main(int argc, char **argv)
 {
-    int i;
-    uint64_t start, used;
-    struct thread *t, *threads;
+    uint64_t used;
+    struct thread *threads;
 
     if (config_init(argc, argv)) {
         return 1;
     }
 
+    if (cfg.worker != NULL) {
+        return cluster_worker() ? 1 : 0;
+    }
+
+    if (cfg.workers != NULL) {
+        return cluster_coordinate(argc, argv) ? 1 : 0;
+    }
+
     threads = threads_create();
     if (threads == NULL) {
         return 1;
     }
 
-    printf("Testing %d threads and %d connections\n@ %s for %ds\n",
-           cfg.threads, cfg.connections, cfg.url, cfg.duration);
+    printf("Testing %d %s and %d connections\n@ %s for %ds\n",
+           cfg.threads, cfg.processes ? "processes" : "threads",
+           cfg.connections, cfg.url, cfg.duration);
+
+    print_memory();
+
+    if (cfg.precise) {
+        printf("  Clock   %s\n", (tsc_scale > 0) ? "TSC" : "clock_gettime");
+    }
+
+    conn_sockopts_report(cfg.addr);
+
+    used = threads_run(threads);
+
+    status_report(threads, used);
+
+    if (cfg.slow != NULL) {
+        (void) slow_dump(threads, cfg.slow);
+    }
+
+    return 0;
+}
+
+
+/*
+ * The memory of a connection without its TLS and kernel state, and
+ * without the request unless it is fixed or replayed.
+ */
+
+static void
+print_memory(void)
+{
+    char buf1[20], buf2[20];
+    size_t size, read_size;
+
+    size = sizeof(struct conn) + sizeof(struct buf);
+    read_size = sizeof(struct conn_buf) + cfg.read_size;
+
+    if (cfg.lean) {
+        printf("  Memory  %s per connection, %s per read buffer in use\n",
+               format_byte(buf1, size), format_byte(buf2, read_size));
+
+    } else {
+        printf("  Memory  %s per connection\n",
+               format_byte(buf1, size + read_size));
+    }
+}
+
+
+uint64_t
+threads_run(struct thread *threads)
+{
+    int i;
+    uint64_t start;
+    struct thread *t;
 
     start = monotonic_time() / 1000;
     signal(SIGINT, sigint_handler);
     sleep(cfg.duration);
 
+    if (cfg.processes) {
+        return processes_run(threads, start);
+    }
+
     for (i = 0; i < cfg.threads; i++) {
         t = &threads[i];
         pthread_cancel(t->handle);
     }
 
-    used = monotonic_time() / 1000 - start;
-
-    status_report(threads, used);
+    for (i = 0; i < cfg.threads; i++) {
+        t = &threads[i];
+        pthread_join(t->handle, NULL);
+    }
 
-    return 0;
+    return monotonic_time() / 1000 - start;
 }
 
 
 static void
 print_usage(char *prog, int status)
 {
-    printf("Usage: %s [-t value] [-c value] [-d value] [-H header] [-s file]"
-           " [-v] [-h] url\n", prog);
+    printf("Usage: %s [options] url\n", prog);
 
     printf("Options:\n");
-    printf(" -t value   Set the value of threads\n");
-    printf(" -c value   Set the value of connections\n");
-    printf(" -d value   Set the value of duration\n");
-    printf(" -H header  Set the request header\n");
-    printf(" -s file    Set the script file\n");
-    printf(" -v         print the version information\n");
-    printf(" -h         print this usage message\n");
-    printf(" url        The required URL to test\n");
+    printf(" -t, --threads value      Set the value of threads\n");
+    printf(" -c, --connections value  Set the value of connections\n");
+    printf(" -d, --duration value     Set the value of duration\n");
+    printf(" -H, --header header      Set the request header\n");
+    printf(" -s, --script file        Set the script file\n");
+    printf(" -W, --worker addr        Run as a worker listening on [host:]port\n");
+    printf(" -w, --workers list       Run on the workers at host:port[,...]\n");
+    printf(" -f, --fork               Run each thread as a separate process\n");
+    printf(" -2, --only-2xx           Count only 2xx in latency and throughput\n");
+    printf("     --think time         Wait ms[-ms] or exp:ms between requests\n");
+    printf("     --lua-gc mode        Set incremental[:pause:stepmul],\n"
+           "                          generational[:minor:major] or manual[:ms]\n");
+    printf("     --replay file        Send the raw requests recorded in file\n");
+    printf("     --replay-order mode  Walk the file by seq, shard or random\n");
+    printf("     --body file          Send the file as the request body\n");
+    printf("     --close              Send Connection: close on every request\n");
+    printf("     --requests value     Reconnect after value requests\n");
+    printf("     --connect-timeout ms Give up a connect after ms\n");
+    printf("     --linger             Reset connections on close\n");
+    printf("     --fastopen           Send the first request in the SYN\n");
+    printf("     --busy-poll us       Set SO_BUSY_POLL\n");
+    printf("     --quickack           Set TCP_QUICKACK after every read\n");
+    printf("     --rcvbuf bytes       Set SO_RCVBUF\n");
+    printf("     --sndbuf bytes       Set SO_SNDBUF\n");
+    printf("     --notsent-lowat n    Set TCP_NOTSENT_LOWAT\n");
+    printf("     --incoming-cpu cpu   Set SO_INCOMING_CPU\n");
+    printf("     --read-buffer bytes  Set the initial read buffer size\n");
+    printf("     --read-max bytes     Set the size read buffers grow up to\n");
+    printf("     --lean               Lend read buffers only while reading\n");
+    printf("     --precise            Time every request with the TSC\n");
+    printf("     --timestamping       Time the wire with kernel timestamps\n");
+    printf("     --counters           Count the CPU work of every worker\n");
+    printf("     --rebalance          Move connections off busy threads\n");
+    printf("     --metrics addr       Serve live metrics on [host:]port\n");
+    printf("     --group-by list      Break down latency by response headers\n");
+    printf("     --slow file          Write the slowest requests to file\n");
+    printf(" -v, --version            print the version information\n");
+    printf(" -h, --help               print this usage message\n");
+    printf(" url                      The required URL to test\n");
 
     exit(status);
 }
 
 
+enum {
+    OPT_THINK = 256,
+    OPT_LUA_GC,
+    OPT_REPLAY,
+    OPT_REPLAY_ORDER,
+    OPT_BODY,
+    OPT_CLOSE,
+    OPT_REQUESTS,
+    OPT_LINGER,
+    OPT_FASTOPEN,
+    OPT_SOCKOPT,
+    OPT_READ_BUFFER,
+    OPT_READ_MAX,
+    OPT_LEAN,
+    OPT_PRECISE,
+    OPT_TIMESTAMPING,
+    OPT_COUNTERS,
+    OPT_REBALANCE,
+    OPT_METRICS,
+    OPT_CONNECT_TIMEOUT,
+    OPT_GROUP_BY,
+    OPT_SLOW,
+};
+
+
+static struct option long_options[] = {
+    { "threads",     required_argument, NULL, 't' },
+    { "connections", required_argument, NULL, 'c' },
+    { "duration",    required_argument, NULL, 'd' },
+    { "header",      required_argument, NULL, 'H' },
+    { "script",      required_argument, NULL, 's' },
+    { "worker",      required_argument, NULL, 'W' },
+    { "workers",     required_argument, NULL, 'w' },
+    { "fork",        no_argument,       NULL, 'f' },
+    { "only-2xx",    no_argument,       NULL, '2' },
+    { "think",       required_argument, NULL, OPT_THINK },
+    { "lua-gc",      required_argument, NULL, OPT_LUA_GC },
+    { "replay",      required_argument, NULL, OPT_REPLAY },
+    { "replay-order", required_argument, NULL, OPT_REPLAY_ORDER },
+    { "body",        required_argument, NULL, OPT_BODY },
+    { "close",       no_argument,       NULL, OPT_CLOSE },
+    { "requests",    required_argument, NULL, OPT_REQUESTS },
+    { "linger",      no_argument,       NULL, OPT_LINGER },
+    { "fastopen",    no_argument,       NULL, OPT_FASTOPEN },
+    { "busy-poll",   required_argument, NULL, OPT_SOCKOPT },
+    { "quickack",    no_argument,       NULL, OPT_SOCKOPT },
+    { "rcvbuf",      required_argument, NULL, OPT_SOCKOPT },
+    { "sndbuf",      required_argument, NULL, OPT_SOCKOPT },
+    { "notsent-lowat", required_argument, NULL, OPT_SOCKOPT },
+    { "incoming-cpu", required_argument, NULL, OPT_SOCKOPT },
+    { "read-buffer", required_argument, NULL, OPT_READ_BUFFER },
+    { "read-max",    required_argument, NULL, OPT_READ_MAX },
+    { "lean",        no_argument,       NULL, OPT_LEAN },
+    { "precise",     no_argument,       NULL, OPT_PRECISE },
+    { "timestamping", no_argument,      NULL, OPT_TIMESTAMPING },
+    { "counters",    no_argument,       NULL, OPT_COUNTERS },
+    { "rebalance",   no_argument,       NULL, OPT_REBALANCE },
+    { "metrics",     required_argument, NULL, OPT_METRICS },
+    { "connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT },
+    { "group-by",    required_argument, NULL, OPT_GROUP_BY },
+    { "slow",        required_argument, NULL, OPT_SLOW },
+    { "version",     no_argument,       NULL, 'v' },
+    { "help",        no_argument,       NULL, 'h' },
+    { NULL,          0,                 NULL, 0 }
+};
+
+
+/*
+ * The think time is either fixed "ms", uniform "min-max", or
+ * exponential "exp:mean" capped at 20 times the mean.
+ */
+
+static int
+parse_think(struct think *think, char *value)
+{
+    char *p;
+    int min, max;
+
+    if (strncmp(value, "exp:", 4) == 0) {
+        min = parse_int(value + 4, strlen(value + 4));
+        if (min <= 0) {
+            return -1;
+        }
+
+        think->exponential = 1;
+        think->min = min;
+        think->max = min * 20;
+
+        return 0;
+    }
+
+    p = strchr(value, '-');
+
+    if (p == NULL) {
+        min = parse_int(value, strlen(value));
+        max = min;
+
+    } else {
+        min = parse_int(value, p - value);
+        max = parse_int(p + 1, strlen(p + 1));
+    }
+
+    if (min < 0 || max < min) {
+        return -1;
+    }
+
+    think->min = min;
+    think->max = max;
+
+    return 0;
+}
+
+
+/*
+ * The collector mode of the scripting states with up to two optional
+ * parameters, zero leaves a Lua default unchanged.  Manual collections
+ * run every second by default.
+ */
+
+static int
+parse_lua_gc(struct script_gc *gc, char *value)
+{
+    char *p;
+    int *args[] = { &gc->arg1, &gc->arg2 };
+    size_t i, length;
+
+    p = strchr(value, ':');
+    length = (p == NULL) ? strlen(value) : (size_t) (p - value);
+
+    if (length == 11 && strncmp(value, "incremental", 11) == 0) {
+        gc->mode = SCRIPT_GC_INCREMENTAL;
+
+    } else if (length == 12 && strncmp(value, "generational", 12) == 0) {
+        gc->mode = SCRIPT_GC_GENERATIONAL;
+
+    } else if (length == 6 && strncmp(value, "manual", 6) == 0) {
+        gc->mode = SCRIPT_GC_MANUAL;
+        gc->arg1 = 1000;
+
+    } else {
+        return -1;
+    }
+
+    for (i = 0; i < countof(args) && p != NULL; i++) {
+        value = p + 1;
+        p = strchr(value, ':');
+        length = (p == NULL) ? strlen(value) : (size_t) (p - value);
+
+        *args[i] = parse_int(value, length);
+        if (*args[i] < 0) {
+            return -1;
+        }
+    }
+
+    if (p != NULL || (gc->mode == SCRIPT_GC_MANUAL && gc->arg1 == 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* The response fields to group by, separated by commas. */
+
+static int
+parse_groups(char *value)
+{
+    char *p, *name;
+
+    p = strdup(value);
+    if (p == NULL) {
+        return -1;
+    }
+
+    cfg.ngroups = 0;
+
+    while ((name = strsep(&p, ",")) != NULL) {
+        if (*name == '\0' || cfg.ngroups == HTTP_PARSE_GROUPS) {
+            return -1;
+        }
+
+        cfg.groups[cfg.ngroups++] = name;
+    }
+
+    return 0;
+}
+
+
 static int
 parse_args(int argc, char **argv)
 {
-    int opt, val;
+    int opt, val, index;
     http_field *field, **last_field;
 
     last_field = &cfg.headers;
 
-    while ((opt = getopt(argc, argv, "t:c:d:H:s:vh")) != -1) {
+    while ((opt = getopt_long(argc, argv, "t:c:d:H:s:W:w:f2vh",
+                              long_options, &index)) != -1)
+    {
         switch (opt) {
         case 't':
             val = parse_int(optarg, strlen(optarg));
@@ -131,6 +423,158 @@ parse_args(int argc, char **argv)
             cfg.script = optarg;
             break;
 
+        case 'W':
+            cfg.worker = optarg;
+            break;
+
+        case 'w':
+            cfg.workers = optarg;
+            break;
+
+        case 'f':
+            cfg.processes = 1;
+            break;
+
+        case '2':
+            cfg.only_2xx = 1;
+            break;
+
+        case OPT_THINK:
+            if (parse_think(&cfg.think, optarg)) {
+                printf("Invalid think time %s\n", optarg);
+                goto fail;
+            }
+            break;
+
+        case OPT_LUA_GC:
+            if (parse_lua_gc(&cfg.lua_gc, optarg)) {
+                printf("Invalid lua gc %s\n", optarg);
+                goto fail;
+            }
+            break;
+
+        case OPT_REPLAY:
+            cfg.replay = optarg;
+            break;
+
+        case OPT_REPLAY_ORDER:
+            if (strcmp(optarg, "seq") == 0) {
+                cfg.replay_order = REPLAY_SEQ;
+
+            } else if (strcmp(optarg, "shard") == 0) {
+                cfg.replay_order = REPLAY_SHARD;
+
+            } else if (strcmp(optarg, "random") == 0) {
+                cfg.replay_order = REPLAY_RANDOM;
+
+            } else {
+                printf("Invalid replay order %s\n", optarg);
+                goto fail;
+            }
+            break;
+
+        case OPT_BODY:
+            cfg.body_file = optarg;
+            break;
+
+        case OPT_CLOSE:
+            field = zcalloc(sizeof(http_field));
+            if (field == NULL) {
+                return ERROR;
+            }
+
+            http_header_parse(field, "Connection: close");
+
+            *last_field = field;
+            last_field = &field->next;
+
+            cfg.conn_requests = 1;
+            break;
+
+        case OPT_REQUESTS:
+            val = parse_int(optarg, strlen(optarg));
+            if (val <= 0) {
+                printf("Invalid requests %d\n", val);
+                goto fail;
+            }
+            cfg.conn_requests = val;
+            break;
+
+        case OPT_CONNECT_TIMEOUT:
+            val = parse_int(optarg, strlen(optarg));
+            if (val <= 0) {
+                printf("Invalid connect timeout %s\n", optarg);
+                goto fail;
+            }
+            cfg.connect_timeout = val;
+            break;
+
+        case OPT_LINGER:
+            cfg.linger = 1;
+            break;
+
+        case OPT_FASTOPEN:
+            cfg.fastopen = 1;
+            break;
+
+        case OPT_READ_BUFFER:
+        case OPT_READ_MAX:
+            val = parse_int(optarg, strlen(optarg));
+            if (val < 1024) {
+                printf("Invalid %s %s\n", long_options[index].name, optarg);
+                goto fail;
+            }
+
+            if (opt == OPT_READ_BUFFER) {
+                cfg.read_size = val;
+
+            } else {
+                cfg.read_max = val;
+            }
+            break;
+
+        case OPT_LEAN:
+            cfg.lean = 1;
+            break;
+
+        case OPT_PRECISE:
+            cfg.precise = 1;
+            break;
+
+        case OPT_TIMESTAMPING:
+            cfg.timestamping = 1;
+            break;
+
+        case OPT_COUNTERS:
+            cfg.counters = 1;
+            break;
+
+        case OPT_REBALANCE:
+            cfg.rebalance = 1;
+            break;
+
+        case OPT_METRICS:
+            cfg.metrics = optarg;
+            break;
+
+        case OPT_SLOW:
+            cfg.slow = optarg;
+            break;
+
+        case OPT_GROUP_BY:
+            if (parse_groups(optarg)) {
+                printf("Invalid group-by %s\n", optarg);
+                goto fail;
+            }
+            break;
+
+        case OPT_SOCKOPT:
+            if (conn_sockopt_set(long_options[index].name, optarg)) {
+                printf("Invalid %s %s\n", long_options[index].name, optarg);
+                goto fail;
+            }
+            break;
+
         case 'v':
             printf("Version %s Copyright (C) Zhidao HONG\n", VERSION);
             return DONE;
@@ -145,6 +589,10 @@ parse_args(int argc, char **argv)
         }
     }
 
+    if (cfg.worker != NULL) {
+        return OK;
+    }
+
     if (optind == argc) {
         printf("Invalid option: url is required\n");
         goto fail;
@@ -155,6 +603,21 @@ parse_args(int argc, char **argv)
         return ERROR;
     }
 
+    if (cfg.rebalance && cfg.processes) {
+        printf("Invalid option: --rebalance needs threads\n");
+        return ERROR;
+    }
+
+    if (cfg.metrics != NULL && cfg.processes) {
+        printf("Invalid option: --metrics needs threads\n");
+        return ERROR;
+    }
+
+    if (cfg.slow != NULL && (cfg.processes || cfg.workers != NULL)) {
+        printf("Invalid option: --slow needs local threads\n");
+        return ERROR;
+    }
+
     cfg.url = argv[optind];
 
     return OK;
@@ -165,17 +628,64 @@ fail:
 }
 
 
+/* The body file is shared by all connections, which send it by offset. */
+
 static int
+body_open(void)
+{
+    struct stat st;
+    http_field *field;
+
+    if (cfg.replay != NULL) {
+        printf("Invalid option: --body cannot be used with --replay\n");
+        return -1;
+    }
+
+    /* The file is framed by Content-Length, not as chunks. */
+
+    for (field = cfg.headers; field != NULL; field = field->next) {
+        if (field->name_length == 17
+            && strncasecmp(field->name, "Transfer-Encoding", 17) == 0)
+        {
+            printf("Invalid option: --body cannot be used with "
+                   "Transfer-Encoding\n");
+            return -1;
+        }
+    }
+
+    cfg.body_fd = open(cfg.body_file, O_RDONLY);
+    if (cfg.body_fd == -1) {
+        printf("open body file %s failed: %s\n", cfg.body_file,
+               strerror(errno));
+        return -1;
+    }
+
+    if (fstat(cfg.body_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        printf("body file %s is not a regular file\n", cfg.body_file);
+        return -1;
+    }
+
+    cfg.body_size = st.st_size;
+
+    return 0;
+}
+
+
+int
 config_init(int argc, char **argv)
 {
     char *service;
     struct url u;
+    struct rlimit rl;
     struct addrinfo *addr;
 
     cfg.threads = 2;
     cfg.connections = 10;
     cfg.duration = 10;
     cfg.timeout = 2000000;
+    cfg.connect_timeout = cfg.timeout / 1000;
+    cfg.read_size = 8192;
+    cfg.read_max = 65536;
 
     switch (parse_args(argc, argv)) {
     case DONE:
@@ -188,6 +698,30 @@ config_init(int argc, char **argv)
         return -1;
     }
 
+    if (cfg.worker != NULL || cfg.workers != NULL) {
+        return 0;
+    }
+
+    cfg.read_max = max_int(cfg.read_max, cfg.read_size);
+
+    if (http_parse_fields_init(cfg.groups, cfg.ngroups)) {
+        printf("Invalid option: --group-by needs distinct header names\n");
+        return -1;
+    }
+
+    if (cfg.precise) {
+        (void) tsc_init();
+    }
+
+    /* Every connection needs a descriptor. */
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0
+        && rl.rlim_cur < cfg.connections + 64)
+    {
+        rl.rlim_cur = min_int(rl.rlim_max, cfg.connections + 64);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
     if (parse_url(&u, cfg.url)) {
         printf("Invalid option: url \"%s\" is invalid\n", cfg.url);
         return -1;
@@ -207,12 +741,26 @@ config_init(int argc, char **argv)
     cfg.addr = addr;
 
     if (strncmp(u.scheme, "https", 5) == 0) {
+        /* TLS reads the socket itself, the times are not seen. */
+        if (cfg.timestamping) {
+            printf("Invalid option: --timestamping needs an http url\n");
+            return -1;
+        }
+
         cfg.ssl = ssl_init();
         if (cfg.ssl == NULL) {
             return -1;
         }
     }
 
+    if (cfg.replay != NULL && replay_open(cfg.replay, cfg.replay_order)) {
+        return -1;
+    }
+
+    if (cfg.body_file != NULL && body_open()) {
+        return -1;
+    }
+
     return 0;
 }
 
@@ -228,8 +776,25 @@ threads_create()
         return NULL;
     }
 
+    if (cfg.processes) {
+        return processes_create(threads);
+    }
+
+    if (cfg.rebalance && balance_init(threads)) {
+        return NULL;
+    }
+
+    if (cfg.metrics != NULL && metrics_init(threads)) {
+        return NULL;
+    }
+
+    if (cfg.slow != NULL && slow_init(threads)) {
+        return NULL;
+    }
+
     for (i = 0; i < cfg.threads; i++) {
         t = &threads[i];
+        t->index = i;
 
         t->engine = event_engine_create(128);
         if (t->engine == NULL) {
@@ -241,6 +806,12 @@ threads_create()
             return NULL;
         }
 
+        if (template_create(t->lua, &t->template)) {
+            return NULL;
+        }
+
+        t->status = t->engine->status;
+
         if (pthread_create(&t->handle, NULL, thread_start, t)) {
             return NULL;
         }
@@ -250,30 +821,175 @@ threads_create()
 }
 
 
+static struct thread *
+processes_create(struct thread *threads)
+{
+    int i;
+    void *shm;
+    struct thread *t;
+
+    for (i = 0; i < cfg.threads; i++) {
+        t = &threads[i];
+        t->index = i;
+
+        shm = mmap(NULL, PROCESS_STATUS_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (shm == MAP_FAILED) {
+            printf("mmap() failed: %s\n", strerror(errno));
+            processes_abort(threads, i);
+            return NULL;
+        }
+
+        /* The status is the first allocation from the shared pool. */
+        t->status = shm;
+
+        fflush(stdout);
+
+        t->pid = fork();
+
+        if (t->pid == 0) {
+            process_start(t, shm);
+        }
+
+        if (t->pid == -1) {
+            printf("fork() failed: %s\n", strerror(errno));
+            munmap(shm, PROCESS_STATUS_SIZE);
+            processes_abort(threads, i);
+            return NULL;
+        }
+
+        if (cfg.counters) {
+            counters_open(t, t->pid);
+        }
+    }
+
+    return threads;
+}
+
+
+/* The processes started before a failure are stopped with their memory. */
+
+static void
+processes_abort(struct thread *threads, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        kill(threads[i].pid, SIGKILL);
+        waitpid(threads[i].pid, NULL, 0);
+
+        munmap(threads[i].status, PROCESS_STATUS_SIZE);
+        threads[i].status = NULL;
+    }
+}
+
+
+static void
+process_start(struct thread *t, void *shm)
+{
+    status_pool_init(shm, PROCESS_STATUS_SIZE);
+
+    t->engine = event_engine_create(128);
+    if (t->engine == NULL || t->engine->status != t->status) {
+        _exit(1);
+    }
+
+    t->lua = script_create();
+    if (t->lua == NULL || template_create(t->lua, &t->template)) {
+        _exit(1);
+    }
+
+    thread_start(t);
+
+    _exit(1);
+}
+
+
+static uint64_t
+processes_run(struct thread *threads, uint64_t start)
+{
+    int i, status;
+    struct thread *t;
+    struct rusage ru;
+
+    for (i = 0; i < cfg.threads; i++) {
+        t = &threads[i];
+
+        /* A worker gone before the end has crashed, its status remains. */
+
+        if (wait4(t->pid, &status, WNOHANG, &ru) == t->pid) {
+            if (!stop) {
+                printf("Process %d exited unexpectedly: %s\n", t->pid,
+                       WIFSIGNALED(status) ? strsignal(WTERMSIG(status))
+                                           : "exit");
+            }
+
+            continue;
+        }
+
+        kill(t->pid, SIGKILL);
+        wait4(t->pid, &status, 0, &ru);
+
+        if (cfg.counters && t->counters_mask == 0) {
+            counters_rusage(t->status, &ru);
+        }
+    }
+
+    return monotonic_time() / 1000 - start;
+}
+
+
 static void *
 thread_start(void *data)
 {
     struct thread *t = data;
     struct thread *thr = cur_thread();
     struct conn *conns, *c;
-    int i, num;
+    struct buf *request;
+    int i, num, first;
 
     thr->engine = t->engine;
     thr->lua = t->lua;
+    thr->template = t->template;
+    thr->slow = t->slow;
 
     thr->time = monotonic_time();
     thr->engine->timers.now = thr->time / 1000000;
+    thr->random = (thr->time ^ ((uintptr_t) t << 16) ^ getpid()) | 1;
 
-    num = cfg.connections / cfg.threads;
+    /* The first threads take one of the remaining connections each. */
+    num = cfg.connections / cfg.threads
+          + (t->index < cfg.connections % cfg.threads);
+    first = t->index * (cfg.connections / cfg.threads)
+            + min_int(t->index, cfg.connections % cfg.threads);
     conns = zcalloc(sizeof(struct conn) * num);
     if (conns == NULL) {
         return NULL;
     }
 
     thr->has_request = script_has_function(thr->lua, "request");
+    thr->has_response = script_has_function(thr->lua, "response");
+
+    if (cfg.replay != NULL) {
+        thr->has_request = 0;
+        replay_cursor_init(&thr->replay, t->index);
+    }
+
+    request = NULL;
+
+    /* A fixed request is shared by all connections of the thread. */
+
+    if (!thr->has_request && cfg.replay == NULL && thr->template == NULL) {
+        lua_getglobal(thr->lua, "http");
+        request = script_request(thr->lua);
+        if (request == NULL) {
+            return NULL;
+        }
+    }
 
     for (i = 0; i < num; i++) {
         c = &conns[i];
+        c->id = first + i;
 
         if (cfg.ssl != NULL) {
             c->ssl = SSL_new(cfg.ssl);
@@ -287,23 +1003,69 @@ thread_start(void *data)
             c->io = &unix_conn_io;
         }
 
-        c->read = buf_alloc(8192);
-        if (c->read == NULL) {
+        if (!cfg.lean && conn_buf_attach(c) != OK) {
             return NULL;
         }
 
-        if (!thr->has_request) {
-            lua_getglobal(thr->lua, "http");
-            c->write = script_request(thr->lua);
+        if (thr->has_request) {
+            /* void */
+
+        } else if (thr->template != NULL) {
+            c->write = buf_alloc(template_size(thr->template));
+            if (c->write == NULL) {
+                return NULL;
+            }
+
+        } else {
+            /* The buffer points into the request or the replay file. */
+            c->write = buf_alloc(0);
             if (c->write == NULL) {
                 return NULL;
             }
+
+            if (request != NULL) {
+                *c->write = *request;
+            }
         }
 
         http_peer_connect(c);
     }
 
+    script_gc_start();
+
+    if (cfg.rebalance) {
+        balance_start(t, num);
+    }
+
+    if (t->metrics != NULL) {
+        metrics_start(t);
+    }
+
+    if (cfg.counters && !cfg.processes) {
+        counters_open(t, 0);
+    }
+
+    pthread_cleanup_push(thread_cleanup, t);
+
     event_engine_start(thr->engine);
 
+    pthread_cleanup_pop(0);
+
     return NULL;
 }
+
+
+/* Without perf events, a cancelled thread reports its own usage. */
+
+static void
+thread_cleanup(void *data)
+{
+    struct thread *t = data;
+    struct rusage ru;
+
+    if (cfg.counters && t->counters_mask == 0
+        && getrusage(RUSAGE_THREAD, &ru) == 0)
+    {
+        counters_rusage(t->status, &ru);
+    }
+}
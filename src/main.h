@@ -4,31 +4,99 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+struct think {
+    uint32_t min;
+    uint32_t max;
+    uint8_t exponential;
+};
+
 struct config {
     int threads;
     int connections;
     int duration;
     int timeout;
+    uint32_t connect_timeout;
+    int only_2xx;
+    struct think think;
+    struct script_gc lua_gc;
+    char *replay;
+    int replay_order;
+    char *body_file;
+    int body_fd;
+    off_t body_size;
+    uint32_t conn_requests;
+    int linger;
+    int fastopen;
+    size_t read_size;
+    size_t read_max;
+    int lean;
+    int precise;
+    int timestamping;
+    int counters;
+    int rebalance;
+    char *metrics;
+    char *slow;
+    char *groups[HTTP_PARSE_GROUPS];
+    int ngroups;
     char *script;
+    char *script_data;
+    size_t script_size;
     char *url;
     char *host;
     char *path;
     http_field *headers;
     struct addrinfo *addr;
     SSL_CTX *ssl;
+    char *worker;
+    char *workers;
+    int processes;
 };
 
 struct thread {
     pthread_t handle; 
+    pid_t pid;
+    int index;
     event_engine *engine;
+    struct status *status;
     lua_State *lua;
+    struct template *template;
+    struct timer gc_timer;
+    struct replay_cursor replay;
+    /* Free grown read buffers, by the number of times they doubled. */
+    struct buf *read_pool[32];
+    /* Free read buffers of the connections. */
+    struct buf *read_bufs;
+    /* The counter descriptors, opened by the bits of the mask. */
+    int counters[COUNTERS];
+    uint32_t counters_mask;
+    struct balance *balance;
+    struct metrics_slot *metrics;
+    struct slow *slow;
     int has_request;
+    int has_response;
     uint64_t time;
+    uint64_t random;
 };
 
 extern struct config cfg;
 
+int config_init(int, char **);
+struct thread *threads_create(void);
+uint64_t threads_run(struct thread *);
+
 #define cur_thread() &thread_ctx;
 extern __thread struct thread thread_ctx;
 
+
+/*
+ * The clock of the phases of a request: the TSC with --precise, else
+ * the time of the wakeup.
+ */
+
+static inline uint64_t
+request_time(struct thread *thr)
+{
+    return cfg.precise ? precise_time() : thr->time;
+}
+
 #endif /* MAIN_H */
@@ -0,0 +1,481 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#include "headers.h"
+
+/*
+ * The metrics are served in the Prometheus text format by a thread of
+ * their own.  Every worker publishes its counters into its slot once a
+ * second with plain atomic stores, so a scrape takes no lock and never
+ * touches the status the worker updates.  The latency quantiles are
+ * those of the last window: a worker records into one histogram while
+ * the other is read, and a generation count lets the reader retry if
+ * the two are swapped meanwhile.
+ */
+
+/*
+ * The scrape connections come from a fixed pool, a handler may still
+ * run for a closed one within the same wakeup and then finds it idle.
+ */
+struct metrics_conn {
+    file_event socket;
+    struct buf *buf;
+    uint8_t ready;
+};
+
+static void *metrics_thread(void *);
+static void metrics_publish(void *, void *);
+static void metrics_accept(void *, void *);
+static void metrics_read(void *, void *);
+static void metrics_write(void *, void *);
+static void metrics_close(struct metrics_conn *);
+static void metrics_response(struct buf *);
+static void metrics_render(struct buf *);
+static void metrics_window(struct metrics_slot *);
+static void metrics_printf(struct buf *, const char *, ...);
+
+#define METRICS_BUFFER  16384
+#define METRICS_HEADER  128
+#define METRICS_CONNS   16
+
+static struct metrics_slot *metrics_slots;
+static file_event metrics_listener;
+static hdr_histogram *metrics_latency;
+static hdr_histogram *metrics_merge;
+static pthread_t metrics_handle;
+static struct metrics_conn metrics_conns[METRICS_CONNS];
+
+
+int
+metrics_init(struct thread *threads)
+{
+    int i, fd;
+    size_t size;
+    struct metrics_slot *slot;
+
+    size = sizeof(struct metrics_slot) * cfg.threads;
+
+    if (posix_memalign((void **) &metrics_slots, 64, size)) {
+        return -1;
+    }
+
+    memzero(metrics_slots, size);
+
+    for (i = 0; i < cfg.threads; i++) {
+        slot = &metrics_slots[i];
+
+        if (hdr_init(1, cfg.timeout * 1000LL, 3, &slot->window[0])
+            || hdr_init(1, cfg.timeout * 1000LL, 3, &slot->window[1]))
+        {
+            return -1;
+        }
+
+        threads[i].metrics = slot;
+    }
+
+    if (hdr_init(1, cfg.timeout * 1000LL, 3, &metrics_latency)
+        || hdr_init(1, cfg.timeout * 1000LL, 3, &metrics_merge))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < METRICS_CONNS; i++) {
+        metrics_conns[i].socket.fd = -1;
+        metrics_conns[i].socket.read_handler = metrics_read;
+        metrics_conns[i].socket.write_handler = metrics_write;
+        metrics_conns[i].socket.data = &metrics_conns[i];
+
+        metrics_conns[i].buf = buf_alloc(METRICS_BUFFER);
+        if (metrics_conns[i].buf == NULL) {
+            return -1;
+        }
+    }
+
+    fd = cluster_listen(cfg.metrics);
+    if (fd == -1) {
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    metrics_listener.fd = fd;
+    metrics_listener.read_handler = metrics_accept;
+
+    if (pthread_create(&metrics_handle, NULL, metrics_thread, NULL)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void
+metrics_start(struct thread *t)
+{
+    struct thread *thr = cur_thread();
+    struct metrics_slot *slot = t->metrics;
+
+    thr->metrics = slot;
+
+    slot->timer.handler = metrics_publish;
+    timer_add(thr->engine, &slot->timer, METRICS_INTERVAL);
+}
+
+
+static void
+metrics_publish(void *obj, void *data)
+{
+    struct thread *thr = cur_thread();
+    struct status *status = thr->engine->status;
+    struct timer *timer = obj;
+    struct metrics_slot *slot = container_of(timer, struct metrics_slot,
+                                             timer);
+    int i, next;
+
+    __atomic_store_n(&slot->requests, status->latency->total_count,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->bytes, status->bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->connects, status->connects, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->connect_errors, status->connect_errors,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->read_errors, status->read_errors,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->write_errors, status->write_errors,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->timeouts, status->timeouts, __ATOMIC_RELAXED);
+
+    for (i = 0; i < STATUS_CLASSES; i++) {
+        __atomic_store_n(&slot->classes[i],
+                         status->class_latency[i]->total_count,
+                         __ATOMIC_RELAXED);
+    }
+
+    if (++slot->ticks % METRICS_WINDOW == 0) {
+        __atomic_store_n(&slot->generation, slot->generation + 1,
+                         __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        next = !slot->current;
+        hdr_reset(slot->window[next]);
+        __atomic_store_n(&slot->current, next, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&slot->generation, slot->generation + 1,
+                         __ATOMIC_RELEASE);
+    }
+
+    timer_add(thr->engine, timer, METRICS_INTERVAL);
+}
+
+
+static void *
+metrics_thread(void *data)
+{
+    struct thread *thr = cur_thread();
+
+    thr->engine = event_engine_create(16);
+    if (thr->engine == NULL) {
+        return NULL;
+    }
+
+    thr->time = monotonic_time();
+    thr->engine->timers.now = thr->time / 1000000;
+
+    if (epoll_add_event(thr->engine, &metrics_listener, EVENT_READ)) {
+        printf("metrics listener failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    event_engine_start(thr->engine);
+
+    return NULL;
+}
+
+
+static void
+metrics_accept(void *obj, void *data)
+{
+    struct thread *thr = cur_thread();
+    struct metrics_conn *mc;
+    int i, fd;
+
+    for ( ;; ) {
+        fd = accept4(metrics_listener.fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return;
+        }
+
+        mc = NULL;
+
+        for (i = 0; i < METRICS_CONNS; i++) {
+            if (metrics_conns[i].socket.fd == -1) {
+                mc = &metrics_conns[i];
+                break;
+            }
+        }
+
+        if (mc == NULL) {
+            close(fd);
+            continue;
+        }
+
+        mc->socket.fd = fd;
+        mc->ready = 0;
+        mc->buf->pos = mc->buf->start;
+        mc->buf->free = mc->buf->start;
+
+        if (epoll_add_event(thr->engine, &mc->socket,
+                            EVENT_READ | EVENT_WRITE))
+        {
+            metrics_close(mc);
+        }
+    }
+}
+
+
+/* Any request is answered with the metrics once its header is read. */
+
+static void
+metrics_read(void *obj, void *data)
+{
+    struct metrics_conn *mc = data;
+    struct buf *b = mc->buf;
+    ssize_t n;
+
+    if (mc->ready || mc->socket.fd == -1) {
+        return;
+    }
+
+    for ( ;; ) {
+        n = read(mc->socket.fd, b->free, b->end - b->free);
+
+        if (n > 0) {
+            b->free += n;
+
+            if (memmem(b->start, b->free - b->start, "\r\n\r\n", 4) != NULL) {
+                metrics_response(b);
+                mc->ready = 1;
+                metrics_write(obj, data);
+                return;
+            }
+
+            if (b->free == b->end) {
+                break;
+            }
+
+            continue;
+        }
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1 && errno == EAGAIN) {
+            return;
+        }
+
+        break;
+    }
+
+    metrics_close(mc);
+}
+
+
+static void
+metrics_write(void *obj, void *data)
+{
+    struct metrics_conn *mc = data;
+    struct buf *b = mc->buf;
+    ssize_t n;
+
+    if (!mc->ready || mc->socket.fd == -1) {
+        return;
+    }
+
+    while (b->pos < b->free) {
+        n = write(mc->socket.fd, b->pos, b->free - b->pos);
+
+        if (n > 0) {
+            b->pos += n;
+            continue;
+        }
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1 && errno == EAGAIN) {
+            return;
+        }
+
+        break;
+    }
+
+    metrics_close(mc);
+}
+
+
+static void
+metrics_close(struct metrics_conn *mc)
+{
+    struct thread *thr = cur_thread();
+
+    epoll_delete_event(thr->engine, &mc->socket, EVENT_READ | EVENT_WRITE);
+    close(mc->socket.fd);
+
+    mc->socket.fd = -1;
+    mc->ready = 0;
+}
+
+
+/* The body is rendered past the room left for the header. */
+
+static void
+metrics_response(struct buf *b)
+{
+    char header[METRICS_HEADER];
+    char *body;
+    int n;
+
+    body = b->start + METRICS_HEADER;
+    b->free = body;
+
+    metrics_render(b);
+
+    n = snprintf(header, sizeof(header),
+                 "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n", (size_t) (b->free - body));
+
+    b->pos = body - n;
+    memcpy(b->pos, header, n);
+}
+
+
+static void
+metrics_render(struct buf *b)
+{
+    int i, j;
+    uint64_t val[7 + STATUS_CLASSES];
+    struct metrics_slot *slot;
+    double quantiles[] = {50, 90, 99, 99.9};
+    static const char *classes[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+
+    memzero(val, sizeof(val));
+    hdr_reset(metrics_latency);
+
+    for (i = 0; i < cfg.threads; i++) {
+        slot = &metrics_slots[i];
+
+        val[0] += __atomic_load_n(&slot->requests, __ATOMIC_RELAXED);
+        val[1] += __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+        val[2] += __atomic_load_n(&slot->connects, __ATOMIC_RELAXED);
+        val[3] += __atomic_load_n(&slot->connect_errors, __ATOMIC_RELAXED);
+        val[4] += __atomic_load_n(&slot->read_errors, __ATOMIC_RELAXED);
+        val[5] += __atomic_load_n(&slot->write_errors, __ATOMIC_RELAXED);
+        val[6] += __atomic_load_n(&slot->timeouts, __ATOMIC_RELAXED);
+
+        for (j = 0; j < STATUS_CLASSES; j++) {
+            val[7 + j] += __atomic_load_n(&slot->classes[j],
+                                          __ATOMIC_RELAXED);
+        }
+
+        metrics_window(slot);
+    }
+
+    metrics_printf(b, "# HELP http_test_requests_total Requests completed.\n"
+                      "# TYPE http_test_requests_total counter\n"
+                      "http_test_requests_total %lu\n", val[0]);
+
+    metrics_printf(b, "# HELP http_test_bytes_total Bytes read.\n"
+                      "# TYPE http_test_bytes_total counter\n"
+                      "http_test_bytes_total %lu\n", val[1]);
+
+    metrics_printf(b, "# HELP http_test_connects_total Connections set up.\n"
+                      "# TYPE http_test_connects_total counter\n"
+                      "http_test_connects_total %lu\n", val[2]);
+
+    metrics_printf(b, "# HELP http_test_responses_total Responses by class.\n"
+                      "# TYPE http_test_responses_total counter\n");
+
+    for (i = 0; i < STATUS_CLASSES; i++) {
+        metrics_printf(b, "http_test_responses_total{class=\"%s\"} %lu\n",
+                       classes[i], val[7 + i]);
+    }
+
+    metrics_printf(b, "# HELP http_test_errors_total Errors by type.\n"
+                      "# TYPE http_test_errors_total counter\n"
+                      "http_test_errors_total{type=\"connect\"} %lu\n"
+                      "http_test_errors_total{type=\"read\"} %lu\n"
+                      "http_test_errors_total{type=\"write\"} %lu\n"
+                      "http_test_errors_total{type=\"timeout\"} %lu\n",
+                   val[3], val[4], val[5], val[6]);
+
+    metrics_printf(b, "# HELP http_test_latency_seconds Latency quantiles "
+                      "of the last %ds.\n"
+                      "# TYPE http_test_latency_seconds gauge\n",
+                   METRICS_INTERVAL * METRICS_WINDOW / 1000);
+
+    for (i = 0; i < countof(quantiles); i++) {
+        metrics_printf(b, "http_test_latency_seconds{quantile=\"%g\"} %.9f\n",
+                       quantiles[i] / 100,
+                       hdr_value_at_percentile(metrics_latency,
+                                               quantiles[i]) / 1e9);
+    }
+
+    metrics_printf(b, "# HELP http_test_latency_window_requests Requests "
+                      "of the last window.\n"
+                      "# TYPE http_test_latency_window_requests gauge\n"
+                      "http_test_latency_window_requests %ld\n",
+                   metrics_latency->total_count);
+}
+
+
+static void
+metrics_window(struct metrics_slot *slot)
+{
+    int tries, current;
+    uint64_t generation;
+
+    for (tries = 0; tries < 8; tries++) {
+        generation = __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE);
+        if (generation & 1) {
+            continue;
+        }
+
+        current = __atomic_load_n(&slot->current, __ATOMIC_RELAXED);
+
+        hdr_reset(metrics_merge);
+        hdr_add(metrics_merge, slot->window[!current]);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->generation, __ATOMIC_RELAXED)
+            == generation)
+        {
+            hdr_add(metrics_latency, metrics_merge);
+            return;
+        }
+    }
+}
+
+
+static void
+metrics_printf(struct buf *b, const char *fmt, ...)
+{
+    int n;
+    va_list args;
+
+    va_start(args, fmt);
+    n = vsnprintf(b->free, b->end - b->free, fmt, args);
+    va_end(args);
+
+    if (n > 0) {
+        b->free += min_int((size_t) n, (size_t) (b->end - b->free));
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * The values of a worker thread as last published for the metrics
+ * thread, in a cache line of its own.  The worker records latencies
+ * into the current window while the other one is published.
+ */
+struct metrics_slot {
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t connects;
+    uint64_t connect_errors;
+    uint64_t read_errors;
+    uint64_t write_errors;
+    uint64_t timeouts;
+    uint64_t classes[STATUS_CLASSES];
+    /* Odd while the windows are swapped. */
+    uint64_t generation;
+    hdr_histogram *window[2];
+    int current;
+    struct timer timer;
+    uint32_t ticks;
+} __attribute__((aligned(64)));
+
+int metrics_init(struct thread *);
+void metrics_start(struct thread *);
+
+static inline void
+metrics_record(struct metrics_slot *slot, uint64_t elapsed)
+{
+    hdr_record_value(slot->window[slot->current], elapsed);
+}
+
+/* The values are published every second, the windows every 10s. */
+#define METRICS_INTERVAL  1000
+#define METRICS_WINDOW    10
+
+#endif /* METRICS_H */
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#include "headers.h"
+
+/*
+ * A replay file is a sequence of raw HTTP requests.  It is mapped
+ * once and shared by all threads and processes, and requests are
+ * sent straight from the mapping, so only the index of the requests
+ * lives in memory.
+ */
+
+struct replay_request {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct replay {
+    char *start;
+    char *end;
+    int order;
+    uint64_t n;
+    struct replay_request *requests;
+    /* The sequential position, shared with the forked workers. */
+    uint64_t *seq;
+};
+
+static int replay_index(struct replay *);
+static char *replay_request_end(char *, char *);
+static char *replay_chunked_end(char *, char *);
+
+static struct replay replay;
+
+
+int
+replay_open(char *path, int order)
+{
+    int fd;
+    struct stat st;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("open replay file %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        printf("replay file %s is empty\n", path);
+        close(fd);
+        return -1;
+    }
+
+    replay.start = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (replay.start == MAP_FAILED) {
+        printf("mmap replay file %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    replay.end = replay.start + st.st_size;
+    replay.order = order;
+
+    madvise(replay.start, st.st_size, MADV_SEQUENTIAL);
+
+    if (replay_index(&replay)) {
+        return -1;
+    }
+
+    if (replay.n == 0) {
+        printf("replay file %s has no requests\n", path);
+        return -1;
+    }
+
+    if (order == REPLAY_RANDOM) {
+        madvise(replay.start, st.st_size, MADV_RANDOM);
+    }
+
+    replay.seq = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (replay.seq == MAP_FAILED) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void
+replay_cursor_init(struct replay_cursor *cursor, int index)
+{
+    cursor->start = 0;
+    cursor->end = replay.n;
+
+    /* A thread without a shard of its own shares one. */
+
+    if (replay.order == REPLAY_SHARD && replay.n >= cfg.threads) {
+        cursor->start = replay.n * index / cfg.threads;
+        cursor->end = replay.n * (index + 1) / cfg.threads;
+    }
+
+    cursor->next = cursor->start;
+}
+
+
+void
+replay_next(struct replay_cursor *cursor, struct buf *b)
+{
+    uint64_t i;
+    struct replay_request *r;
+    struct thread *thr = cur_thread();
+
+    switch (replay.order) {
+
+    case REPLAY_SHARD:
+        i = cursor->next++;
+
+        if (cursor->next == cursor->end) {
+            cursor->next = cursor->start;
+        }
+
+        break;
+
+    case REPLAY_RANDOM:
+        i = random_next(&thr->random) % replay.n;
+        break;
+
+    default:
+        i = __atomic_fetch_add(replay.seq, 1, __ATOMIC_RELAXED) % replay.n;
+        break;
+    }
+
+    r = &replay.requests[i];
+
+    b->start = replay.start + r->offset;
+    b->pos = b->start;
+    b->free = b->start + r->length;
+    b->end = b->free;
+}
+
+
+static int
+replay_index(struct replay *rp)
+{
+    char *p, *end;
+    uint64_t size;
+    struct replay_request *requests;
+
+    size = 0;
+    p = rp->start;
+
+    for ( ;; ) {
+        /* Line breaks between requests are skipped. */
+
+        while (p < rp->end && (*p == '\r' || *p == '\n')) {
+            p++;
+        }
+
+        if (p == rp->end) {
+            break;
+        }
+
+        end = replay_request_end(p, rp->end);
+        if (end == NULL) {
+            printf("Invalid replay request at offset %" PRIu64 "\n",
+                   (uint64_t) (p - rp->start));
+            return -1;
+        }
+
+        if (rp->n == size) {
+            size = (size == 0) ? 1024 : size * 2;
+
+            requests = zrealloc(rp->requests,
+                                size * sizeof(struct replay_request));
+            if (requests == NULL) {
+                return -1;
+            }
+
+            rp->requests = requests;
+        }
+
+        rp->requests[rp->n].offset = p - rp->start;
+        rp->requests[rp->n].length = end - p;
+        rp->n++;
+
+        p = end;
+    }
+
+    return 0;
+}
+
+
+static char *
+replay_request_end(char *p, char *end)
+{
+    char *head, *line, *next;
+    size_t length;
+    uint64_t content_length;
+    int chunked;
+
+    head = memmem(p, end - p, "\r\n\r\n", 4);
+    if (head == NULL) {
+        return NULL;
+    }
+
+    content_length = 0;
+    chunked = 0;
+
+    /* The request line is skipped, it has no colon before the value. */
+
+    line = memchr(p, '\n', head - p);
+
+    while (line != NULL && line < head) {
+        line++;
+        next = memchr(line, '\n', head + 2 - line);
+        length = next - line;
+
+        if (length > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtoull(line + 15, NULL, 10);
+
+        } else if (length > 18
+                   && strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+        {
+            chunked = (memmem(line + 18, length - 18, "chunked", 7) != NULL);
+        }
+
+        line = next;
+    }
+
+    head += 4;
+
+    if (chunked) {
+        return replay_chunked_end(head, end);
+    }
+
+    if (content_length > end - head) {
+        return NULL;
+    }
+
+    return head + content_length;
+}
+
+
+static char *
+replay_chunked_end(char *p, char *end)
+{
+    char *line;
+    uint64_t size;
+
+    for ( ;; ) {
+        line = memmem(p, end - p, "\r\n", 2);
+        if (line == NULL) {
+            return NULL;
+        }
+
+        size = strtoull(p, NULL, 16);
+
+        if (size == 0) {
+            /* The trailers end with an empty line. */
+            p = memmem(line, end - line, "\r\n\r\n", 4);
+            return (p == NULL) ? NULL : p + 4;
+        }
+
+        if (size + 2 > end - line - 2) {
+            return NULL;
+        }
+
+        p = line + 2 + size + 2;
+    }
+}
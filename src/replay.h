@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+enum {
+    REPLAY_SEQ = 0,
+    REPLAY_SHARD,
+    REPLAY_RANDOM,
+};
+
+/* The requests of a thread, all of them unless sharded. */
+struct replay_cursor {
+    uint64_t start;
+    uint64_t next;
+    uint64_t end;
+};
+
+int replay_open(char *path, int order);
+void replay_cursor_init(struct replay_cursor *, int index);
+void replay_next(struct replay_cursor *, struct buf *);
+
+#endif /* REPLAY_H */
@@ -3,13 +3,89 @@
  */
 #include "headers.h"
 
+/*
+ * A view of the response being processed.  It points into the
+ * connection read buffer and is only valid during the response hook.
+ */
+struct script_view {
+    char *start;
+    char *end;
+    uint8_t chunked;
+};
+
+/*
+ * Every state allocates its small blocks from free lists of size
+ * classes, carved out of chunks that are kept for the lifetime of the
+ * state.  A state is only used by its own thread, so there is no
+ * locking, and the per request tables and strings are recycled
+ * without going through malloc().
+ */
+#define SCRIPT_ALIGN    16
+#define SCRIPT_SMALL    512
+#define SCRIPT_CLASSES  (SCRIPT_SMALL / SCRIPT_ALIGN)
+#define SCRIPT_CHUNK    (64 * 1024)
+
+struct script_pool {
+    void *free[SCRIPT_CLASSES];
+    char *pos;
+    char *end;
+};
+
+#define script_class(size)                                                    \
+    (((size) - 1) / SCRIPT_ALIGN)
+
+/* Metatable names, the views themselves are kept under the same names. */
+#define SCRIPT_HEADERS  "http.headers"
+#define SCRIPT_BODY     "http.body"
+/* The registry table of the tags seen by the state. */
+#define SCRIPT_TAGS     "http.tags"
+
+static void *script_alloc(void *, void *, size_t, size_t);
+static void *script_pool_alloc(struct script_pool *, size_t);
+static void script_pool_free(struct script_pool *, void *, size_t);
+static void script_gc_init(lua_State *);
+static int script_gc_sentinel(lua_State *);
+static void script_gc_handler(void *, void *);
+static void script_view_create(lua_State *, const char *, const luaL_Reg *);
+static struct script_view *script_view_push(lua_State *, const char *);
+static struct script_view *script_view_check(lua_State *, const char *);
+static char *script_header_next(struct script_view *, char *,
+    char **, size_t *, char **, size_t *);
+static char *script_headers_first(struct script_view *);
+static int script_headers_index(lua_State *);
+static int script_headers_pairs(lua_State *);
+static int script_headers_next(lua_State *);
+static size_t script_body_decode(struct script_view *, luaL_Buffer *);
+static int script_body_tostring(lua_State *);
+static int script_body_len(lua_State *);
+
+static const luaL_Reg script_headers_meta[] = {
+    { "__index", script_headers_index },
+    { "__pairs", script_headers_pairs },
+    { NULL, NULL }
+};
+
+static const luaL_Reg script_body_meta[] = {
+    { "__tostring", script_body_tostring },
+    { "__len", script_body_len },
+    { NULL, NULL }
+};
+
+
 lua_State *
 script_create()
 {
+    int ret;
     lua_State *L;
     http_field *field;
+    struct script_pool *pool;
 
-    L = luaL_newstate();
+    pool = zcalloc(sizeof(struct script_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    L = lua_newstate(script_alloc, pool);
     if (L == NULL) {
         return NULL;
     }
@@ -18,7 +94,7 @@ script_create()
 
     lua_newtable(L);
 
-    lua_pushstring(L, "GET");
+    lua_pushstring(L, (cfg.body_file != NULL) ? "POST" : "GET");
     lua_setfield(L, -2, "method");
 
     lua_pushstring(L, cfg.path);
@@ -34,16 +110,231 @@ script_create()
 
     lua_setglobal(L, "http");
 
-    if (cfg.script && luaL_dofile(L, cfg.script) != LUA_OK) {
+    script_view_create(L, SCRIPT_HEADERS, script_headers_meta);
+    script_view_create(L, SCRIPT_BODY, script_body_meta);
+
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, SCRIPT_TAGS);
+
+    if (cfg.script_data != NULL) {
+        ret = luaL_loadbuffer(L, cfg.script_data, cfg.script_size, cfg.script)
+              || lua_pcall(L, 0, LUA_MULTRET, 0);
+
+    } else if (cfg.script != NULL) {
+        ret = luaL_dofile(L, cfg.script);
+
+    } else {
+        ret = LUA_OK;
+    }
+
+    if (ret != LUA_OK) {
         const char *err = lua_tostring(L, -1);
         printf("load script %s failed: %s\n", cfg.script, err);
         return NULL;
     }
 
+    script_gc_init(L);
+
     return L;
 }
 
 
+/* Calls a hook, the time spent includes the collector steps it runs. */
+
+void
+script_call(lua_State *L, int nargs, int nresults)
+{
+    uint64_t start;
+    struct thread *thr = cur_thread();
+
+    start = monotonic_time();
+
+    lua_call(L, nargs, nresults);
+
+    thr->engine->status->script_time += monotonic_time() - start;
+}
+
+
+void
+script_gc_start(void)
+{
+    struct thread *thr = cur_thread();
+
+    if (cfg.lua_gc.mode != SCRIPT_GC_MANUAL) {
+        return;
+    }
+
+    thr->gc_timer.handler = script_gc_handler;
+    timer_add(thr->engine, &thr->gc_timer, cfg.lua_gc.arg1);
+}
+
+
+static void
+script_gc_init(lua_State *L)
+{
+    struct script_gc *gc = &cfg.lua_gc;
+
+    switch (gc->mode) {
+
+    case SCRIPT_GC_INCREMENTAL:
+        lua_gc(L, LUA_GCINC, gc->arg1, gc->arg2, 0);
+        break;
+
+    case SCRIPT_GC_GENERATIONAL:
+        lua_gc(L, LUA_GCGEN, gc->arg1, gc->arg2);
+        break;
+
+    case SCRIPT_GC_MANUAL:
+        lua_gc(L, LUA_GCCOLLECT);
+        lua_gc(L, LUA_GCSTOP);
+        break;
+    }
+
+    /* A finalized sentinel marks the end of every cycle. */
+
+    lua_newuserdatauv(L, 0, 0);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, script_gc_sentinel);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    lua_pop(L, 1);
+}
+
+
+static int
+script_gc_sentinel(lua_State *L)
+{
+    struct thread *thr = cur_thread();
+
+    if (thr->engine != NULL) {
+        thr->engine->status->gc_cycles++;
+    }
+
+    /* The next one, it is not finalized again while the state closes. */
+
+    lua_newuserdatauv(L, 0, 0);
+    lua_getmetatable(L, 1);
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+
+static void
+script_gc_handler(void *obj, void *data)
+{
+    uint64_t start;
+    struct thread *thr = cur_thread();
+
+    start = monotonic_time();
+
+    lua_gc(thr->lua, LUA_GCCOLLECT);
+
+    thr->engine->status->gc_time += monotonic_time() - start;
+
+    timer_add(thr->engine, &thr->gc_timer, cfg.lua_gc.arg1);
+}
+
+
+static void *
+script_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    void *p;
+    struct script_pool *pool = ud;
+
+    /* Without a block, the old size is the type of the new object. */
+    if (ptr == NULL) {
+        osize = 0;
+    }
+
+    if (nsize == 0) {
+        if (ptr != NULL) {
+            script_pool_free(pool, ptr, osize);
+        }
+
+        return NULL;
+    }
+
+    if (osize > SCRIPT_SMALL && nsize > SCRIPT_SMALL) {
+        return zrealloc(ptr, nsize);
+    }
+
+    if (ptr != NULL && osize <= SCRIPT_SMALL && nsize <= SCRIPT_SMALL
+        && script_class(osize) == script_class(nsize))
+    {
+        return ptr;
+    }
+
+    p = script_pool_alloc(pool, nsize);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    if (ptr != NULL) {
+        memcpy(p, ptr, min_int(osize, nsize));
+        script_pool_free(pool, ptr, osize);
+    }
+
+    return p;
+}
+
+
+static void *
+script_pool_alloc(struct script_pool *pool, size_t size)
+{
+    void *p;
+    size_t n;
+
+    if (size > SCRIPT_SMALL) {
+        return zmalloc(size);
+    }
+
+    n = script_class(size);
+
+    p = pool->free[n];
+    if (p != NULL) {
+        pool->free[n] = *(void **) p;
+        return p;
+    }
+
+    size = (n + 1) * SCRIPT_ALIGN;
+
+    if (pool->end - pool->pos < size) {
+        pool->pos = zmalloc(SCRIPT_CHUNK);
+        if (pool->pos == NULL) {
+            return NULL;
+        }
+
+        pool->end = pool->pos + SCRIPT_CHUNK;
+    }
+
+    p = pool->pos;
+    pool->pos += size;
+
+    return p;
+}
+
+
+static void
+script_pool_free(struct script_pool *pool, void *p, size_t size)
+{
+    size_t n;
+
+    if (size > SCRIPT_SMALL) {
+        zfree(p);
+        return;
+    }
+
+    n = script_class(size);
+
+    *(void **) p = pool->free[n];
+    pool->free[n] = p;
+}
+
+
 int
 script_has_function(lua_State *L, const char *name)
 {
@@ -58,6 +349,79 @@ script_has_function(lua_State *L, const char *name)
 }
 
 
+/*
+ * The tag of the request table is interned once per state, as a pointer
+ * to its entry in the tag table of the thread status.
+ */
+
+struct status_group_value *
+script_tag(lua_State *L, struct status_group *tags)
+{
+    size_t length;
+    const char *tag;
+    struct status_group_value *v;
+
+    lua_getfield(L, -1, "tag");
+
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, SCRIPT_TAGS);
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+
+    v = lua_touserdata(L, -1);
+
+    if (v == NULL) {
+        tag = lua_tolstring(L, -3, &length);
+        v = status_group_find(tags, (char *) tag, length);
+
+        if (v != NULL) {
+            lua_pushvalue(L, -3);
+            lua_pushlightuserdata(L, v);
+            lua_rawset(L, -4);
+        }
+    }
+
+    lua_pop(L, 3);
+
+    return v;
+}
+
+
+/*
+ * The delay of the request table in ms, or -1 without one.  It is
+ * clamped to what the timers hold, and a fraction waits a whole ms.
+ */
+
+int64_t
+script_delay(lua_State *L)
+{
+    int isnum;
+    double delay;
+
+    lua_getfield(L, -1, "delay");
+    delay = lua_tonumberx(L, -1, &isnum);
+    lua_pop(L, 1);
+
+    if (!isnum) {
+        return -1;
+    }
+
+    if (!(delay > 0)) {
+        return 0;
+    }
+
+    if (delay > INT32_MAX) {
+        return INT32_MAX;
+    }
+
+    return (int64_t) ceil(delay);
+}
+
+
 struct buf *
 script_request(lua_State *L)
 {
@@ -95,6 +459,11 @@ script_request(lua_State *L)
     body_length = body != NULL ? strlen(body) : 0;
     lua_pop(L, 1);
 
+    /* A body file replaces the body. */
+    if (cfg.body_file != NULL) {
+        body_length = 0;
+    }
+
     lua_getfield(L, -1, "headers");
     if (!lua_istable(L, -1)) {
         lua_pop(L, 1);
@@ -130,6 +499,14 @@ script_request(lua_State *L)
             return NULL;
         }
 
+        /* A body file is sent with its Content-Length, never chunked. */
+        if (chunked && cfg.body_file != NULL
+            && strcmp(name, "Transfer-Encoding") == 0)
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+
         luaL_addstring(&buffer, name);
         luaL_addstring(&buffer, ": ");
         luaL_addstring(&buffer, value);
@@ -145,6 +522,14 @@ script_request(lua_State *L)
         luaL_addstring(&buffer, "Content-Length: ");
         luaL_addstring(&buffer, num);
         luaL_addstring(&buffer, "\r\n");
+
+    } else if (cfg.body_file != NULL) {
+        /* The body is sent from the file after the request. */
+        char num[24];
+        sprintf(num, "%" PRIu64, (uint64_t) cfg.body_size);
+        luaL_addstring(&buffer, "Content-Length: ");
+        luaL_addstring(&buffer, num);
+        luaL_addstring(&buffer, "\r\n");
     }
 
     luaL_addstring(&buffer, "\r\n");
@@ -175,3 +560,294 @@ script_request(lua_State *L)
 
     return b;
 }
+
+
+void
+script_response(lua_State *L, struct conn *c)
+{
+    struct script_view *headers, *body;
+
+    lua_getglobal(L, "http");
+    lua_getfield(L, -1, "response");
+
+    lua_pushinteger(L, c->parser->status);
+
+    /* Headers as large as the maximum read buffer were overwritten. */
+
+    headers = NULL;
+
+    if (c->header_size == 0) {
+        lua_pushnil(L);
+
+    } else {
+        headers = script_view_push(L, SCRIPT_HEADERS);
+        headers->start = c->read->start;
+        headers->end = c->read->start + c->header_size;
+    }
+
+    body = NULL;
+
+    if (c->body_truncated) {
+        lua_pushnil(L);
+
+    } else {
+        body = script_view_push(L, SCRIPT_BODY);
+        body->start = c->read->start + c->header_size;
+        body->end = c->read->pos;
+        body->chunked = c->parser->chunked;
+    }
+
+    script_call(L, 3, 0);
+    lua_pop(L, 1);
+
+    if (headers != NULL) {
+        headers->start = NULL;
+    }
+
+    if (body != NULL) {
+        body->start = NULL;
+    }
+}
+
+
+static void
+script_view_create(lua_State *L, const char *name, const luaL_Reg *meta)
+{
+    struct script_view *view;
+
+    view = lua_newuserdatauv(L, sizeof(struct script_view), 0);
+    memzero(view, sizeof(struct script_view));
+
+    luaL_newmetatable(L, name);
+    luaL_setfuncs(L, meta, 0);
+
+    /* The metatable keeps the view. */
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, "view");
+
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+}
+
+
+static struct script_view *
+script_view_push(lua_State *L, const char *name)
+{
+    luaL_getmetatable(L, name);
+    lua_getfield(L, -1, "view");
+    lua_remove(L, -2);
+
+    return lua_touserdata(L, -1);
+}
+
+
+static struct script_view *
+script_view_check(lua_State *L, const char *name)
+{
+    struct script_view *view;
+
+    view = luaL_checkudata(L, 1, name);
+
+    if (view->start == NULL) {
+        luaL_error(L, "response is used outside of http.response");
+    }
+
+    return view;
+}
+
+
+/* Returns the position after the next header line, or NULL at the end. */
+
+static char *
+script_header_next(struct script_view *view, char *p,
+    char **name, size_t *name_length, char **value, size_t *value_length)
+{
+    char *nl, *colon, *end;
+
+    nl = memchr(p, '\n', view->end - p);
+    if (nl == NULL) {
+        return NULL;
+    }
+
+    end = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+
+    colon = memchr(p, ':', end - p);
+    if (colon == NULL) {
+        return NULL;
+    }
+
+    *name = p;
+    *name_length = colon - p;
+
+    p = colon + 1;
+
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    *value = p;
+    *value_length = end - p;
+
+    return nl + 1;
+}
+
+
+static char *
+script_headers_first(struct script_view *view)
+{
+    char *p;
+
+    /* Skip the status line. */
+    p = memchr(view->start, '\n', view->end - view->start);
+
+    return (p != NULL) ? p + 1 : view->end;
+}
+
+
+static int
+script_headers_index(lua_State *L)
+{
+    char *p, *name, *value;
+    size_t length, name_length, value_length;
+    const char *key;
+    struct script_view *view;
+
+    view = script_view_check(L, SCRIPT_HEADERS);
+    key = luaL_checklstring(L, 2, &length);
+
+    p = script_headers_first(view);
+
+    while ((p = script_header_next(view, p, &name, &name_length,
+                                   &value, &value_length)) != NULL)
+    {
+        if (name_length == length && memcasecmp(name, key, length) == 0) {
+            lua_pushlstring(L, value, value_length);
+            return 1;
+        }
+    }
+
+    lua_pushnil(L);
+
+    return 1;
+}
+
+
+static int
+script_headers_pairs(lua_State *L)
+{
+    struct script_view *view;
+
+    view = script_view_check(L, SCRIPT_HEADERS);
+
+    lua_pushinteger(L, script_headers_first(view) - view->start);
+    lua_pushcclosure(L, script_headers_next, 1);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+script_headers_next(lua_State *L)
+{
+    char *p, *name, *value;
+    size_t name_length, value_length;
+    struct script_view *view;
+
+    view = script_view_check(L, SCRIPT_HEADERS);
+
+    p = view->start + lua_tointeger(L, lua_upvalueindex(1));
+
+    p = script_header_next(view, p, &name, &name_length,
+                           &value, &value_length);
+    if (p == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushinteger(L, p - view->start);
+    lua_replace(L, lua_upvalueindex(1));
+
+    lua_pushlstring(L, name, name_length);
+    lua_pushlstring(L, value, value_length);
+
+    return 2;
+}
+
+
+/* Decodes a chunked body into the Lua buffer, or only counts it. */
+
+static size_t
+script_body_decode(struct script_view *view, luaL_Buffer *buffer)
+{
+    size_t size;
+    struct buf in, *b, *out, *next;
+    http_chunk_parser parser;
+
+    memzero(&in, sizeof(struct buf));
+    memzero(&parser, sizeof(http_chunk_parser));
+
+    in.pos = view->start;
+    in.free = view->end;
+
+    out = http_parse_chunk(&parser, &in);
+
+    size = 0;
+
+    for (b = out; b != NULL; b = next) {
+        next = b->next;
+        size += b->free - b->pos;
+
+        if (buffer != NULL) {
+            luaL_addlstring(buffer, b->pos, b->free - b->pos);
+        }
+
+        zfree(b);
+    }
+
+    return size;
+}
+
+
+static int
+script_body_tostring(lua_State *L)
+{
+    luaL_Buffer buffer;
+    struct script_view *view;
+
+    view = script_view_check(L, SCRIPT_BODY);
+
+    if (!view->chunked) {
+        lua_pushlstring(L, view->start, view->end - view->start);
+        return 1;
+    }
+
+    luaL_buffinit(L, &buffer);
+    script_body_decode(view, &buffer);
+    luaL_pushresult(&buffer);
+
+    return 1;
+}
+
+
+static int
+script_body_len(lua_State *L)
+{
+    struct script_view *view;
+
+    view = script_view_check(L, SCRIPT_BODY);
+
+    if (!view->chunked) {
+        lua_pushinteger(L, view->end - view->start);
+
+    } else {
+        lua_pushinteger(L, script_body_decode(view, NULL));
+    }
+
+    return 1;
+}
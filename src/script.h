@@ -8,8 +8,33 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+enum {
+    SCRIPT_GC_DEFAULT = 0,
+    SCRIPT_GC_INCREMENTAL,
+    SCRIPT_GC_GENERATIONAL,
+    SCRIPT_GC_MANUAL,
+};
+
+/*
+ * The collector of the scripting states: the pause and step multiplier
+ * of the incremental mode, the minor and major multipliers of the
+ * generational mode, or the interval in ms of full collections.
+ */
+struct script_gc {
+    uint8_t mode;
+    int arg1;
+    int arg2;
+};
+
+struct status_group;
+
 lua_State *script_create(void);
+void script_call(lua_State *, int, int);
+void script_gc_start(void);
 int script_has_function(lua_State *, const char *);
+struct status_group_value *script_tag(lua_State *, struct status_group *);
+int64_t script_delay(lua_State *);
 struct buf *script_request(lua_State *);
+void script_response(lua_State *, struct conn *);
 
 #endif /* SCRIPT_H */
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#include "headers.h"
+
+/*
+ * Every thread keeps its slowest requests in a min heap, whose root is
+ * the latency a request must exceed to get in, and a uniform sample of
+ * all requests by the skips of Algorithm L, so that a request that is
+ * neither slow nor sampled costs a comparison and two counts.  The
+ * entries are allocated once and written over.
+ */
+
+static void slow_fill(struct slow *, struct slow_entry *, struct conn *,
+    uint64_t);
+static void slow_sift(struct slow *);
+static void slow_skip(struct slow *, uint64_t *);
+static double slow_uniform(uint64_t *);
+static int slow_compare(const void *, const void *);
+static void slow_print(FILE *, struct slow_entry *);
+static void slow_print_string(FILE *, char *, size_t);
+
+static struct slow *slows;
+
+
+int
+slow_init(struct thread *threads)
+{
+    int i;
+
+    slows = zcalloc(sizeof(struct slow) * cfg.threads);
+    if (slows == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < cfg.threads; i++) {
+        slows[i].next = 1;
+        slows[i].weight = 1;
+        slows[i].thread = i;
+
+        threads[i].slow = &slows[i];
+    }
+
+    return 0;
+}
+
+
+void
+slow_capture(struct slow *slow, struct conn *c, uint64_t elapsed)
+{
+    struct thread *thr = cur_thread();
+    struct slow_entry *e;
+
+    if (elapsed > slow->top[0].latency) {
+        slow_fill(slow, &slow->top[0], c, elapsed);
+        slow_sift(slow);
+    }
+
+    if (slow->seen != slow->next) {
+        return;
+    }
+
+    if (slow->seen <= SLOW_SAMPLE) {
+        e = &slow->sample[slow->seen - 1];
+        slow->next++;
+
+        if (slow->seen == SLOW_SAMPLE) {
+            slow_skip(slow, &thr->random);
+        }
+
+    } else {
+        e = &slow->sample[random_next(&thr->random) % SLOW_SAMPLE];
+        slow_skip(slow, &thr->random);
+    }
+
+    slow_fill(slow, e, c, elapsed);
+}
+
+
+static void
+slow_fill(struct slow *slow, struct slow_entry *e, struct conn *c,
+    uint64_t elapsed)
+{
+    char *p, *end;
+
+    e->latency = elapsed;
+    e->start = c->start;
+    e->sent = (c->sent != 0) ? (int64_t) (c->sent - c->start) : -1;
+    e->first = (c->first != 0) ? (int64_t) (c->first - c->start) : -1;
+    e->header = (c->header != 0) ? (int64_t) (c->header - c->start) : -1;
+    e->bytes = c->received;
+    e->conn = c->id;
+    e->fresh = (c->requests == 0);
+    e->connect = e->fresh ? c->connect_time : 0;
+    e->status = (c->header != 0) ? c->parser->status : 0;
+    e->thread = slow->thread;
+
+    e->tag_length = 0;
+
+    if (c->tag != NULL) {
+        e->tag_length = c->tag->length;
+        memcpy(e->tag, c->tag->value, c->tag->length);
+    }
+
+    p = c->write->start;
+    end = p + min_int(c->write->free - p, SLOW_REQUEST);
+
+    while (p < end && *p != '\r' && *p != '\n') {
+        p++;
+    }
+
+    e->request_length = p - c->write->start;
+    memcpy(e->request, c->write->start, e->request_length);
+}
+
+
+static void
+slow_sift(struct slow *slow)
+{
+    int i, child;
+    struct slow_entry e;
+
+    e = slow->top[0];
+
+    for (i = 0; (child = 2 * i + 1) < SLOW_TOP; i = child) {
+        if (child + 1 < SLOW_TOP
+            && slow->top[child + 1].latency < slow->top[child].latency)
+        {
+            child++;
+        }
+
+        if (e.latency <= slow->top[child].latency) {
+            break;
+        }
+
+        slow->top[i] = slow->top[child];
+    }
+
+    slow->top[i] = e;
+}
+
+
+/*
+ * The weight falls with the requests seen, and the number of requests
+ * to skip is drawn from it, not from a random value per request.
+ */
+
+static void
+slow_skip(struct slow *slow, uint64_t *random)
+{
+    double skip;
+
+    slow->weight *= exp(log(slow_uniform(random)) / SLOW_SAMPLE);
+
+    skip = floor(log(slow_uniform(random)) / log(1 - slow->weight));
+
+    if (!(skip < 1e15)) {
+        skip = 1e15;
+    }
+
+    slow->next = slow->seen + 1 + (uint64_t) skip;
+}
+
+
+/* Returns a uniform value in (0, 1]. */
+
+static double
+slow_uniform(uint64_t *random)
+{
+    return 1 - random_double(random);
+}
+
+
+int
+slow_dump(struct thread *threads, char *file)
+{
+    int i, j, n;
+    FILE *fp;
+    uint64_t seen;
+    struct slow *slow;
+    struct slow_entry **entries;
+
+    entries = zmalloc(sizeof(struct slow_entry *) * SLOW_TOP * cfg.threads);
+    if (entries == NULL) {
+        return -1;
+    }
+
+    fp = fopen(file, "w");
+    if (fp == NULL) {
+        printf("open slow requests file %s failed: %s\n", file,
+               strerror(errno));
+        zfree(entries);
+        return -1;
+    }
+
+    n = 0;
+    seen = 0;
+
+    for (i = 0; i < cfg.threads; i++) {
+        slow = threads[i].slow;
+        seen += slow->seen;
+
+        for (j = 0; j < SLOW_TOP; j++) {
+            if (slow->top[j].latency > 0) {
+                entries[n++] = &slow->top[j];
+            }
+        }
+    }
+
+    qsort(entries, n, sizeof(struct slow_entry *), slow_compare);
+
+    fprintf(fp, "{\n  \"requests\": %lu,\n  \"slowest\": [", seen);
+
+    for (i = 0; i < n; i++) {
+        fprintf(fp, (i > 0) ? ",\n    " : "\n    ");
+        slow_print(fp, entries[i]);
+    }
+
+    fprintf(fp, "\n  ],\n  \"sample\": [");
+
+    for (i = 0, n = 0; i < cfg.threads; i++) {
+        slow = threads[i].slow;
+
+        for (j = 0; j < min_int(slow->seen, SLOW_SAMPLE); j++) {
+            fprintf(fp, (n++ > 0) ? ",\n    " : "\n    ");
+            slow_print(fp, &slow->sample[j]);
+        }
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+
+    zfree(entries);
+
+    if (fclose(fp) != 0) {
+        printf("write slow requests file %s failed: %s\n", file,
+               strerror(errno));
+        return -1;
+    }
+
+    printf("\nThe slowest requests and a sample of %lu are in %s\n", seen,
+           file);
+
+    return 0;
+}
+
+
+static int
+slow_compare(const void *p1, const void *p2)
+{
+    const struct slow_entry *e1 = *(struct slow_entry **) p1;
+    const struct slow_entry *e2 = *(struct slow_entry **) p2;
+
+    return (e1->latency < e2->latency) - (e1->latency > e2->latency);
+}
+
+
+static void
+slow_print(FILE *fp, struct slow_entry *e)
+{
+    fprintf(fp, "{\"latency\": %lu, \"thread\": %d, \"conn\": %u, "
+            "\"fresh\": %s, ", e->latency, e->thread, e->conn,
+            e->fresh ? "true" : "false");
+
+    if (e->fresh) {
+        fprintf(fp, "\"connect\": %lu, ", e->connect * 1000UL);
+    }
+
+    fprintf(fp, "\"start\": %lu, \"sent\": %ld, \"first_byte\": %ld, "
+            "\"header\": %ld, \"status\": %d, \"bytes\": %lu, ",
+            e->start, e->sent, e->first, e->header, e->status, e->bytes);
+
+    if (e->tag_length > 0) {
+        fprintf(fp, "\"tag\": ");
+        slow_print_string(fp, e->tag, e->tag_length);
+        fprintf(fp, ", ");
+    }
+
+    fprintf(fp, "\"request\": ");
+    slow_print_string(fp, e->request, e->request_length);
+    fprintf(fp, "}");
+}
+
+
+static void
+slow_print_string(FILE *fp, char *p, size_t length)
+{
+    u_char c;
+    size_t i;
+
+    fputc('"', fp);
+
+    for (i = 0; i < length; i++) {
+        c = p[i];
+
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+
+        } else if (c < 0x20 || c >= 0x7f) {
+            fprintf(fp, "\\u%04x", c);
+
+        } else {
+            fputc(c, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#ifndef SLOW_H
+#define SLOW_H
+
+/* The slowest requests and a uniform sample of them, per thread. */
+#define SLOW_TOP      32
+#define SLOW_SAMPLE   32
+/* The bytes of the request line kept. */
+#define SLOW_REQUEST  64
+
+/*
+ * The phase times are in ns from the start of the request, -1 for the
+ * phases a timed out request did not reach.
+ */
+struct slow_entry {
+    uint64_t latency;
+    uint64_t start;
+    int64_t sent;
+    int64_t first;
+    int64_t header;
+    uint64_t bytes;
+    uint32_t conn;
+    /* The time in us of the connect, for the first request. */
+    uint32_t connect;
+    uint16_t status;
+    uint16_t thread;
+    uint8_t fresh;
+    uint8_t tag_length;
+    uint8_t request_length;
+    char tag[STATUS_GROUP_VALUE];
+    char request[SLOW_REQUEST];
+};
+
+struct slow {
+    /* A min heap by latency, of empty entries until it fills up. */
+    struct slow_entry top[SLOW_TOP];
+    struct slow_entry sample[SLOW_SAMPLE];
+    uint64_t seen;
+    /* The request the sample takes next, and its weight. */
+    uint64_t next;
+    double weight;
+    int thread;
+};
+
+int slow_init(struct thread *);
+void slow_capture(struct slow *, struct conn *, uint64_t);
+int slow_dump(struct thread *, char *);
+
+
+/* A request faster than all the slowest ones is only counted. */
+
+static inline void
+slow_record(struct slow *slow, struct conn *c, uint64_t elapsed)
+{
+    slow->seen++;
+
+    if (elapsed > slow->top[0].latency || slow->seen == slow->next) {
+        slow_capture(slow, c, elapsed);
+    }
+}
+
+#endif /* SLOW_H */
@@ -6,12 +6,14 @@
 static int ssl_connected(struct conn *, char *host);
 static ssize_t ssl_recv(struct conn *, void *, size_t);
 static ssize_t ssl_send(struct conn *, void *, size_t);
+static ssize_t ssl_send_file(struct conn *, int, off_t *, size_t);
 static void ssl_close(struct conn *);
 
 conn_io ssl_conn_io = {
     .connected = ssl_connected,
     .recv = ssl_recv,
     .send = ssl_send,
+    .send_file = ssl_send_file,
     .close = ssl_close,
 };
 
@@ -98,6 +100,38 @@ ssl_send(struct conn *c, void *buf, size_t size)
 }
 
 
+/*
+ * A file is encrypted in chunks read into a buffer of the thread.  A
+ * retried write reads the same chunk again, as SSL_write() requires.
+ */
+
+#define SSL_FILE_CHUNK  16384
+
+static __thread char ssl_file_chunk[SSL_FILE_CHUNK];
+
+
+static ssize_t
+ssl_send_file(struct conn *c, int fd, off_t *offset, size_t size)
+{
+    ssize_t n;
+
+    size = min_int(size, SSL_FILE_CHUNK);
+
+    n = pread(fd, ssl_file_chunk, size, *offset);
+    if (n <= 0) {
+        return ERROR;
+    }
+
+    n = ssl_send(c, ssl_file_chunk, n);
+
+    if (n > 0) {
+        *offset += n;
+    }
+
+    return n;
+}
+
+
 static void
 ssl_close(struct conn *c)
 {
@@ -3,56 +3,811 @@
  */
 #include "headers.h"
 
+static void status_group_merge(struct status_group *, struct status_group *);
+static struct status_group_value *status_group_other(struct status_group *);
+static size_t status_group_size(struct status_group *);
+static char *status_encode_group(char *, struct status_group *);
+static int status_decode_group(struct status_group *, char **, char *);
 static void print_request(struct status *, uint64_t);
 static void print_latency(hdr_histogram *);
+static void print_wire(struct status *);
+static void print_codes(struct status *);
 static void print_errors(struct status *);
+static void print_concurrency(struct status *);
+static void print_groups(struct status *, uint64_t);
+static void print_group(char *, struct status_group *, uint64_t);
+static void print_status(struct status *, uint64_t, struct thread *);
+static void print_script(struct status *, char *);
+static void print_loop(struct status *, char *);
+static void print_wakeups(struct status *);
+static int print_warnings(struct status *, char *, int);
+static double loop_busy(struct status *);
+static void print_counters(struct status *, char *, uint64_t);
+
+/* The event loop busy percent and mean timer lag in ns warned about. */
+#define STATUS_BUSY_WARN  90
+#define STATUS_LAG_WARN   2000000
+
+/*
+ * Worker processes allocate their status from a shared memory pool,
+ * so the parent can read it while they run and after they are gone.
+ */
+static struct buf status_pool;
+
+
+void
+status_pool_init(void *start, size_t size)
+{
+    status_pool.start = start;
+    status_pool.free = start;
+    status_pool.end = (char *) start + size;
+}
+
+
+static void *
+status_alloc(size_t size)
+{
+    void *p;
+
+    if (status_pool.start == NULL) {
+        return zcalloc(size);
+    }
+
+    size = (size + 15) & ~((size_t) 15);
+
+    if (status_pool.end - status_pool.free < size) {
+        return NULL;
+    }
+
+    p = status_pool.free;
+    status_pool.free += size;
+
+    return p;
+}
+
+
+hdr_histogram *
+status_histogram_create(int64_t lowest, int64_t highest, int figures)
+{
+    size_t size;
+    hdr_histogram *hdr, *p;
+
+    if (hdr_init(lowest, highest, figures, &hdr)) {
+        return NULL;
+    }
+
+    if (status_pool.start == NULL) {
+        return hdr;
+    }
+
+    /* A histogram is a single block, so it can be moved as it is. */
+
+    size = hdr_get_memory_size(hdr);
+
+    p = status_alloc(size);
+    if (p != NULL) {
+        memcpy(p, hdr, size);
+    }
+
+    zfree(hdr);
+
+    return p;
+}
 
 
 struct status *
 status_create(void)
 {
-    struct status *status;
+    int i;
+    struct status *status;
+
+    status = status_alloc(sizeof(struct status));
+    if (status == NULL) {
+        return NULL;
+    }
+
+    /* Latencies are in nanoseconds, the timeout in microseconds. */
+
+    status->latency = status_histogram_create(1, cfg.timeout * 1000LL, 3);
+    if (status->latency == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < STATUS_CLASSES; i++) {
+        status->class_latency[i] = status_histogram_create(1,
+                                                           cfg.timeout * 1000LL,
+                                                           3);
+        if (status->class_latency[i] == NULL) {
+            return NULL;
+        }
+    }
+
+    status->wire_latency = status_histogram_create(1, cfg.timeout * 1000LL, 3);
+    if (status->wire_latency == NULL) {
+        return NULL;
+    }
+
+    status->groups = status_alloc(cfg.ngroups * sizeof(struct status_group));
+    if (cfg.ngroups > 0 && status->groups == NULL) {
+        return NULL;
+    }
+
+    status->seconds = cfg.duration + 1;
+    status->concurrency = status_alloc(status->seconds * sizeof(uint64_t));
+    if (status->concurrency == NULL) {
+        return NULL;
+    }
+
+    return status;
+}
+
+
+void
+status_merge(struct status *status, struct status *stats)
+{
+    int i;
+
+    status->bytes += stats->bytes;
+    hdr_add(status->latency, stats->latency);
+
+    for (i = 0; i < STATUS_CODES; i++) {
+        status->codes[i] += stats->codes[i];
+    }
+
+    for (i = 0; i < STATUS_CLASSES; i++) {
+        hdr_add(status->class_latency[i], stats->class_latency[i]);
+    }
+
+    hdr_add(status->wire_latency, stats->wire_latency);
+
+    status->connects += stats->connects;
+    status->fastopen_connects += stats->fastopen_connects;
+    status->fastopen_accepted += stats->fastopen_accepted;
+    status->read_grows += stats->read_grows;
+    status->connect_errors += stats->connect_errors;
+    status->read_errors += stats->read_errors;
+    status->write_errors += stats->write_errors;
+    status->timeouts += stats->timeouts;
+
+    status->script_time += stats->script_time;
+    status->gc_time += stats->gc_time;
+    status->gc_cycles += stats->gc_cycles;
+
+    for (i = 0; i < COUNTERS; i++) {
+        status->counters[i] += stats->counters[i];
+    }
+
+    status->counters_mask |= stats->counters_mask;
+
+    status->loop_busy += stats->loop_busy;
+    status->loop_wait += stats->loop_wait;
+    status->loop_events += stats->loop_events;
+
+    for (i = 0; i < STATUS_WAKEUPS; i++) {
+        status->loop_wakeups[i] += stats->loop_wakeups[i];
+    }
+
+    status->loop_lag += stats->loop_lag;
+    status->loop_lags += stats->loop_lags;
+    status->loop_lag_max = max_int(status->loop_lag_max, stats->loop_lag_max);
+
+    status->handoffs += stats->handoffs;
+
+    for (i = 0; i < min_int(stats->sampled, status->seconds); i++) {
+        status->concurrency[i] += stats->concurrency[i];
+    }
+
+    status->sampled = max_int(status->sampled, i);
+
+    for (i = 0; i < cfg.ngroups; i++) {
+        status_group_merge(&status->groups[i], &stats->groups[i]);
+    }
+
+    status_group_merge(&status->tags, &stats->tags);
+}
+
+
+static void
+status_group_merge(struct status_group *group, struct status_group *g)
+{
+    int i;
+    struct status_group_value *v, *to;
+
+    for (i = 0; i <= g->nvalues; i++) {
+        v = (i < g->nvalues) ? &g->values[i] : &g->other;
+
+        if (v->latency == NULL) {
+            continue;
+        }
+
+        to = (v == &g->other) ? status_group_other(group)
+                              : status_group_find(group, v->value, v->length);
+
+        if (to != NULL) {
+            hdr_add(to->latency, v->latency);
+            to->errors += v->errors;
+        }
+    }
+}
+
+
+/*
+ * The table of a group keeps the values in the order they are first
+ * seen, the values that come after it is full or do not fit in it are
+ * counted together.
+ */
+
+struct status_group_value *
+status_group_find(struct status_group *g, char *value, size_t length)
+{
+    uint32_t i;
+    struct status_group_value *v;
+
+    /* A longer value would be cut and merged with others. */
+    if (length > STATUS_GROUP_VALUE) {
+        return status_group_other(g);
+    }
+
+    for (i = 0; i < g->nvalues; i++) {
+        v = &g->values[i];
+
+        if (v->length == length && memcmp(v->value, value, length) == 0) {
+            return v;
+        }
+    }
+
+    if (g->nvalues == STATUS_GROUP_VALUES) {
+        return status_group_other(g);
+    }
+
+    v = &g->values[g->nvalues];
+
+    v->latency = status_histogram_create(1, cfg.timeout * 1000LL, 3);
+    if (v->latency == NULL) {
+        return NULL;
+    }
+
+    memcpy(v->value, value, length);
+    v->length = length;
+    g->nvalues++;
+
+    return v;
+}
+
+
+static struct status_group_value *
+status_group_other(struct status_group *g)
+{
+    struct status_group_value *v;
+
+    v = &g->other;
+
+    if (v->latency == NULL) {
+        v->latency = status_histogram_create(1, cfg.timeout * 1000LL, 3);
+        if (v->latency == NULL) {
+            return NULL;
+        }
+    }
+
+    return v;
+}
+
+
+/*
+ * The open connections are sampled on the ticks of the engine, the
+ * first tick of every second keeps its count, and the seconds a busy
+ * loop skipped repeat it.
+ */
+
+void
+status_sample(struct status *status, uint64_t now)
+{
+    uint64_t second;
+
+    if (status->start == 0) {
+        status->start = now;
+    }
+
+    second = (now - status->start) / 1000000000;
+
+    while (status->sampled <= second && status->sampled < status->seconds) {
+        status->concurrency[status->sampled++] = status->active;
+    }
+}
+
+
+struct status *
+status_collect(struct thread *threads)
+{
+    int i;
+    struct status *status;
+
+    status = status_create();
+    if (status == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < cfg.threads; i++) {
+        if (cfg.counters) {
+            counters_read(&threads[i]);
+        }
+
+        status_merge(status, threads[i].status);
+    }
+
+    return status;
+}
+
+
+void
+status_print(struct status *status, uint64_t time)
+{
+    print_status(status, time, NULL);
+}
+
+
+void status_report(struct thread *threads, uint64_t time)
+{
+    struct status *status;
+
+    status = status_collect(threads);
+    if (status == NULL) {
+        return;
+    }
+
+    print_status(status, time, (cfg.threads > 1) ? threads : NULL);
+}
+
+
+/* The per thread lines follow the totals when threads is not NULL. */
+
+static void
+print_status(struct status *status, uint64_t time, struct thread *threads)
+{
+    int i, warned;
+    char name[20];
+
+    print_request(status, time);
+    print_latency(status->latency);
+    print_wire(status);
+    print_codes(status);
+    print_groups(status, time);
+    print_errors(status);
+    print_concurrency(status);
+
+    printf("\nEvent Loop:\n");
+    print_loop(status, "Total");
+
+    for (i = 0; threads != NULL && i < cfg.threads; i++) {
+        sprintf(name, "#%d", i);
+        print_loop(threads[i].status, name);
+    }
+
+    print_wakeups(status);
+
+    if (status->handoffs > 0) {
+        printf("  Moved   %lu connections between threads\n",
+               status->handoffs);
+    }
+
+    if (status->counters_mask != 0) {
+        printf("\nCPU per request:\n");
+        print_counters(status, "Total", time);
+
+        for (i = 0; threads != NULL && i < cfg.threads; i++) {
+            sprintf(name, "#%d", i);
+            print_counters(threads[i].status, name, time);
+        }
+    }
+
+    if (status->script_time > 0 || status->gc_cycles > 0) {
+        printf("\nScript:\n");
+        print_script(status, "Total");
+
+        for (i = 0; threads != NULL && i < cfg.threads; i++) {
+            sprintf(name, "#%d", i);
+            print_script(threads[i].status, name);
+        }
+    }
+
+    if (threads == NULL) {
+        print_warnings(status, "The client", 0);
+        return;
+    }
+
+    for (i = 0, warned = 0; i < cfg.threads; i++) {
+        sprintf(name, "Thread #%d", i);
+        warned = print_warnings(threads[i].status, name, warned);
+    }
+}
+
+
+/*
+ * The encoded status is a sequence of 64-bit big-endian words: the
+ * counters first, then every histogram as its parameters followed by
+ * its raw counts, so that the receiver can rebuild an identical
+ * histogram and merge it exactly.
+ */
+
+#define STATUS_LOOP      (13 + COUNTERS)
+#define STATUS_COUNTERS  (STATUS_LOOP + 7 + STATUS_WAKEUPS)
+
+
+static char *
+status_encode_value(char *p, uint64_t val)
+{
+    val = htobe64(val);
+    return cpymem(p, &val, sizeof(uint64_t));
+}
+
+
+static int
+status_decode_value(char **pos, char *end, uint64_t *val)
+{
+    if (end - *pos < sizeof(uint64_t)) {
+        return ERROR;
+    }
+
+    memcpy(val, *pos, sizeof(uint64_t));
+    *val = be64toh(*val);
+    *pos += sizeof(uint64_t);
+
+    return OK;
+}
+
+
+static char *
+status_encode_histogram(char *p, hdr_histogram *hdr)
+{
+    int32_t i;
+
+    p = status_encode_value(p, hdr->lowest_trackable_value);
+    p = status_encode_value(p, hdr->highest_trackable_value);
+    p = status_encode_value(p, hdr->significant_figures);
+    p = status_encode_value(p, hdr->counts_len);
+
+    for (i = 0; i < hdr->counts_len; i++) {
+        p = status_encode_value(p, hdr->counts[i]);
+    }
+
+    return p;
+}
+
+
+static int
+status_decode_histogram(char **pos, char *end, hdr_histogram *to)
+{
+    int32_t i;
+    uint64_t val[4];
+    hdr_histogram *hdr;
+
+    for (i = 0; i < countof(val); i++) {
+        if (status_decode_value(pos, end, &val[i])) {
+            return ERROR;
+        }
+    }
+
+    /* The layout comes from a peer, it is checked before allocating. */
+
+    if (val[0] < 1 || val[1] > INT64_MAX || val[0] > val[1] / 2
+        || val[2] < 1 || val[2] > 5
+        || val[3] > (uint64_t) (end - *pos) / sizeof(uint64_t))
+    {
+        return ERROR;
+    }
+
+    if (hdr_init(val[0], val[1], val[2], &hdr)) {
+        return ERROR;
+    }
+
+    if (hdr->counts_len != val[3]) {
+        goto fail;
+    }
+
+    for (i = 0; i < hdr->counts_len; i++) {
+        if (status_decode_value(pos, end, (uint64_t *) &hdr->counts[i])) {
+            goto fail;
+        }
+
+        hdr->total_count += hdr->counts[i];
+    }
+
+    hdr_add(to, hdr);
+    zfree(hdr);
+
+    return OK;
+
+fail:
+
+    zfree(hdr);
+    return ERROR;
+}
+
+
+size_t
+status_encode_size(struct status *status)
+{
+    int i;
+    size_t size;
+
+    size = STATUS_COUNTERS + STATUS_CODES + 4 + status->latency->counts_len;
+
+    for (i = 0; i < STATUS_CLASSES; i++) {
+        size += 4 + status->class_latency[i]->counts_len;
+    }
+
+    size += 4 + status->wire_latency->counts_len;
+    size += 1 + status->sampled;
+
+    for (i = 0; i < cfg.ngroups; i++) {
+        size += status_group_size(&status->groups[i]);
+    }
+
+    size += status_group_size(&status->tags);
+
+    return size * sizeof(uint64_t);
+}
+
+
+char *
+status_encode(struct status *status, char *p)
+{
+    int i;
+
+    p = status_encode_value(p, status->bytes);
+    p = status_encode_value(p, status->connect_errors);
+    p = status_encode_value(p, status->read_errors);
+    p = status_encode_value(p, status->write_errors);
+    p = status_encode_value(p, status->timeouts);
+    p = status_encode_value(p, status->script_time);
+    p = status_encode_value(p, status->gc_time);
+    p = status_encode_value(p, status->gc_cycles);
+    p = status_encode_value(p, status->connects);
+    p = status_encode_value(p, status->fastopen_connects);
+    p = status_encode_value(p, status->fastopen_accepted);
+    p = status_encode_value(p, status->read_grows);
+    p = status_encode_value(p, status->counters_mask);
+
+    for (i = 0; i < COUNTERS; i++) {
+        p = status_encode_value(p, status->counters[i]);
+    }
+
+    p = status_encode_value(p, status->loop_busy);
+    p = status_encode_value(p, status->loop_wait);
+    p = status_encode_value(p, status->loop_events);
+    p = status_encode_value(p, status->loop_lag);
+    p = status_encode_value(p, status->loop_lags);
+    p = status_encode_value(p, status->loop_lag_max);
+
+    for (i = 0; i < STATUS_WAKEUPS; i++) {
+        p = status_encode_value(p, status->loop_wakeups[i]);
+    }
+
+    p = status_encode_value(p, status->handoffs);
+
+    for (i = 0; i < STATUS_CODES; i++) {
+        p = status_encode_value(p, status->codes[i]);
+    }
+
+    p = status_encode_histogram(p, status->latency);
+
+    for (i = 0; i < STATUS_CLASSES; i++) {
+        p = status_encode_histogram(p, status->class_latency[i]);
+    }
+
+    p = status_encode_histogram(p, status->wire_latency);
+
+    p = status_encode_value(p, status->sampled);
+
+    for (i = 0; i < status->sampled; i++) {
+        p = status_encode_value(p, status->concurrency[i]);
+    }
+
+    for (i = 0; i < cfg.ngroups; i++) {
+        p = status_encode_group(p, &status->groups[i]);
+    }
+
+    p = status_encode_group(p, &status->tags);
+
+    return p;
+}
+
+
+/*
+ * A group goes as the number of its values, every value as its length,
+ * its bytes, its errors and its histogram, then whether the other values
+ * follow with their errors and histogram.
+ */
+
+static size_t
+status_group_size(struct status_group *g)
+{
+    int i;
+    size_t size;
+
+    size = 2;
+
+    for (i = 0; i < g->nvalues; i++) {
+        size += 2 + STATUS_GROUP_VALUE / 8
+                + 4 + g->values[i].latency->counts_len;
+    }
+
+    if (g->other.latency != NULL) {
+        size += 1 + 4 + g->other.latency->counts_len;
+    }
+
+    return size;
+}
+
+
+static char *
+status_encode_group(char *p, struct status_group *g)
+{
+    int i;
+    struct status_group_value *v;
+
+    p = status_encode_value(p, g->nvalues);
+
+    for (i = 0; i < g->nvalues; i++) {
+        v = &g->values[i];
+
+        p = status_encode_value(p, v->length);
+        p = cpymem(p, v->value, STATUS_GROUP_VALUE);
+        p = status_encode_value(p, v->errors);
+        p = status_encode_histogram(p, v->latency);
+    }
+
+    p = status_encode_value(p, g->other.latency != NULL);
+
+    if (g->other.latency != NULL) {
+        p = status_encode_value(p, g->other.errors);
+        p = status_encode_histogram(p, g->other.latency);
+    }
+
+    return p;
+}
+
+
+static int
+status_decode_group(struct status_group *g, char **pos, char *end)
+{
+    uint64_t i, n, length, errors;
+    char value[STATUS_GROUP_VALUE];
+    struct status_group_value *v;
 
-    status = zcalloc(sizeof(struct status));
-    if (status == NULL) {
-        return NULL;
+    if (status_decode_value(pos, end, &n) || n > STATUS_GROUP_VALUES) {
+        return ERROR;
     }
 
-    hdr_init(1, cfg.timeout, 3, &status->latency);
+    for (i = 0; i <= n; i++) {
+        if (i < n) {
+            if (status_decode_value(pos, end, &length)
+                || length > STATUS_GROUP_VALUE
+                || end - *pos < STATUS_GROUP_VALUE)
+            {
+                return ERROR;
+            }
 
-    return status;
+            memcpy(value, *pos, STATUS_GROUP_VALUE);
+            *pos += STATUS_GROUP_VALUE;
+
+            v = status_group_find(g, value, length);
+
+        } else {
+            if (status_decode_value(pos, end, &length)) {
+                return ERROR;
+            }
+
+            if (length == 0) {
+                break;
+            }
+
+            v = status_group_other(g);
+        }
+
+        if (v == NULL
+            || status_decode_value(pos, end, &errors)
+            || status_decode_histogram(pos, end, v->latency))
+        {
+            return ERROR;
+        }
+
+        v->errors += errors;
+    }
+
+    return OK;
 }
 
 
-void status_report(struct thread *threads, uint64_t time)
+int
+status_decode(struct status *status, char *p, char *end)
 {
     int i;
-    struct thread *t;
-    struct status *status, *stats;
+    uint64_t n, val[STATUS_COUNTERS + STATUS_CODES];
 
-    status = status_create();
-    if (status == NULL) {
-        return;
+    for (i = 0; i < countof(val); i++) {
+        if (status_decode_value(&p, end, &val[i])) {
+            return ERROR;
+        }
     }
 
-    hdr_init(1, cfg.timeout, 3, &status->latency);
+    status->bytes += val[0];
+    status->connect_errors += val[1];
+    status->read_errors += val[2];
+    status->write_errors += val[3];
+    status->timeouts += val[4];
+    status->script_time += val[5];
+    status->gc_time += val[6];
+    status->gc_cycles += val[7];
+    status->connects += val[8];
+    status->fastopen_connects += val[9];
+    status->fastopen_accepted += val[10];
+    status->read_grows += val[11];
+    status->counters_mask |= val[12];
 
-    for (i = 0; i < cfg.threads; i++) {
-        t = &threads[i];
-        stats = t->engine->status;
+    for (i = 0; i < COUNTERS; i++) {
+        status->counters[i] += val[13 + i];
+    }
 
-        status->bytes += stats->bytes;
-        hdr_add(status->latency, stats->latency);
+    status->loop_busy += val[STATUS_LOOP];
+    status->loop_wait += val[STATUS_LOOP + 1];
+    status->loop_events += val[STATUS_LOOP + 2];
+    status->loop_lag += val[STATUS_LOOP + 3];
+    status->loop_lags += val[STATUS_LOOP + 4];
+    status->loop_lag_max = max_int(status->loop_lag_max, val[STATUS_LOOP + 5]);
 
-        status->connect_errors += stats->connect_errors;
-        status->read_errors += stats->read_errors;
-        status->write_errors += stats->write_errors;
-        status->timeouts += stats->timeouts;
+    for (i = 0; i < STATUS_WAKEUPS; i++) {
+        status->loop_wakeups[i] += val[STATUS_LOOP + 6 + i];
     }
 
-    print_request(status, time);
-    print_latency(status->latency);
-    print_errors(status);
+    status->handoffs += val[STATUS_LOOP + 6 + STATUS_WAKEUPS];
+
+    for (i = 0; i < STATUS_CODES; i++) {
+        status->codes[i] += val[STATUS_COUNTERS + i];
+    }
+
+    if (status_decode_histogram(&p, end, status->latency)) {
+        return ERROR;
+    }
+
+    for (i = 0; i < STATUS_CLASSES; i++) {
+        if (status_decode_histogram(&p, end, status->class_latency[i])) {
+            return ERROR;
+        }
+    }
+
+    if (status_decode_histogram(&p, end, status->wire_latency)) {
+        return ERROR;
+    }
+
+    if (status_decode_value(&p, end, &val[0])) {
+        return ERROR;
+    }
+
+    for (i = 0; i < val[0]; i++) {
+        if (status_decode_value(&p, end, &val[1])) {
+            return ERROR;
+        }
+
+        if (i < status->seconds) {
+            status->concurrency[i] += val[1];
+        }
+    }
+
+    n = min_int(val[0], status->seconds);
+    status->sampled = max_int(status->sampled, n);
+
+    for (i = 0; i < cfg.ngroups; i++) {
+        if (status_decode_group(&status->groups[i], &p, end)) {
+            return ERROR;
+        }
+    }
+
+    if (status_decode_group(&status->tags, &p, end)) {
+        return ERROR;
+    }
+
+    return OK;
 }
 
 
@@ -67,11 +822,21 @@ static void print_request(struct status *status, uint64_t time) {
     bytes = status->bytes;
 
     format_byte(buf1, bytes);
-    format_time(buf2, time);
+    format_time(buf2, time * 1000);
 
     printf("\n%lu requests and %s bytes in %s\n", requests, buf1, buf2);
     printf("  Requests/sec  %lu\n", requests / cfg.duration);
+    printf("  Connects/sec  %lu\n", status->connects / cfg.duration);
+
+    if (status->fastopen_connects > 0) {
+        printf("  Fast Open     %lu of %lu accepted\n",
+               status->fastopen_accepted, status->fastopen_connects);
+    }
     printf("  Transfer/sec  %s\n", format_byte(buf1, bytes / cfg.duration));
+
+    if (status->read_grows > 0) {
+        printf("  Buffer grows  %lu\n", status->read_grows);
+    }
 }
 
 
@@ -129,20 +894,417 @@ static void print_latency(hdr_histogram *hdr) {
 }
 
 
+/*
+ * The wire latency goes from the kernel sending the last byte of the
+ * request to it receiving the last byte of the response, the rest of
+ * the latency is spent in the client.
+ */
+
+static void print_wire(struct status *status) {
+    int i, percents[] = {50, 90, 99};
+    char buf[20];
+    double delay;
+    hdr_histogram *hdr;
+
+    hdr = status->wire_latency;
+
+    if (hdr->total_count == 0) {
+        return;
+    }
+
+    printf("\nWire Latency:\n");
+    printf("  Mean      %s\n", format_time(buf, hdr_mean(hdr)));
+
+    for (i = 0; i < countof(percents); i++) {
+        format_time(buf, hdr_value_at_percentile(hdr, percents[i]));
+        printf("  %d%%       %s\n", percents[i], buf);
+    }
+
+    delay = hdr_mean(status->latency) - hdr_mean(hdr);
+
+    printf("  Client    %s%s\n", (delay < 0) ? "-" : "",
+           format_time(buf, fabs(delay)));
+}
+
+
+static void print_codes(struct status *status) {
+    int i, j, percents[] = {50, 90, 99};
+    char buf[20];
+    uint64_t responses;
+    hdr_histogram *hdr;
+
+    responses = 0;
+
+    for (i = 0; i < STATUS_CODES; i++) {
+        responses += status->codes[i];
+    }
+
+    if (responses == 0) {
+        return;
+    }
+
+    printf("\nStatus Codes:\n");
+
+    for (i = 0; i < STATUS_CODES; i++) {
+        if (status->codes[i] > 0) {
+            printf("  %d  %lu\n", i, status->codes[i]);
+        }
+    }
+
+    /* Per class latency only matters when the classes are mixed. */
+
+    if (status->class_latency[1]->total_count == responses) {
+        return;
+    }
+
+    printf("\nLatency by Status:\n");
+
+    for (i = 0; i < STATUS_CLASSES; i++) {
+        hdr = status->class_latency[i];
+
+        if (hdr->total_count == 0) {
+            continue;
+        }
+
+        printf("  %dxx  Mean %s", i + 1, format_time(buf, hdr_mean(hdr)));
+
+        for (j = 0; j < countof(percents); j++) {
+            format_time(buf, hdr_value_at_percentile(hdr, percents[j]));
+            printf("  %d%% %s", percents[j], buf);
+        }
+
+        printf("\n");
+    }
+}
+
+
+/*
+ * Every group field and tag shows the rate and latency of its values,
+ * the rate over the time in us the run took.
+ */
+
+static void print_groups(struct status *status, uint64_t time) {
+    int i;
+
+    time = max_int(time, 1);
+
+    for (i = 0; i < cfg.ngroups; i++) {
+        print_group(cfg.groups[i], &status->groups[i], time);
+    }
+
+    print_group("Tag", &status->tags, time);
+}
+
+
+static void print_group(char *name, struct status_group *g, uint64_t time) {
+    int i, j, width, percents[] = {50, 90, 99};
+    char buf[20];
+    struct status_group_value *v;
+
+    if (g->nvalues == 0) {
+        return;
+    }
+
+    width = 7;
+
+    for (i = 0; i < g->nvalues; i++) {
+        width = max_int(width, g->values[i].length);
+    }
+
+    printf("\nLatency by %s:\n", name);
+
+    for (i = 0; i <= g->nvalues; i++) {
+        v = (i < g->nvalues) ? &g->values[i] : &g->other;
+
+        if (v->latency == NULL
+            || (v->latency->total_count == 0 && v->errors == 0))
+        {
+            continue;
+        }
+
+        if (v == &g->other) {
+            printf("  %-*s", width, "(other)");
+
+        } else if (v->length == 0) {
+            printf("  %-*s", width, "(none)");
+
+        } else {
+            printf("  %-*.*s", width, (int) v->length, v->value);
+        }
+
+        printf("  %lu/s  Mean %s",
+               v->latency->total_count * 1000000 / time,
+               format_time(buf, hdr_mean(v->latency)));
+
+        for (j = 0; j < countof(percents); j++) {
+            format_time(buf, hdr_value_at_percentile(v->latency, percents[j]));
+            printf("  %d%% %s", percents[j], buf);
+        }
+
+        if (v->errors > 0) {
+            printf("  Errors %lu", v->errors);
+        }
+
+        printf("\n");
+    }
+}
+
+
+/*
+ * The percent is over all the responses and errors, the latency may
+ * count only the 2xx responses.
+ */
+
 static void print_errors(struct status *status) {
+    int i;
+    uint64_t non2xx = 0, responses = 0;
     uint32_t errors = status->connect_errors
                       + status->read_errors
                       + status->write_errors
                       + status->timeouts;
 
-    if (errors > 0) {
-        double percent = (double) errors / status->latency->total_count;
+    for (i = 0; i < STATUS_CODES; i++) {
+        responses += status->codes[i];
+
+        if (i < 200 || i > 299) {
+            non2xx += status->codes[i];
+        }
+    }
+
+    if (errors > 0 || non2xx > 0) {
+        double percent = (double) errors / max_int(responses + errors, 1);
 
         printf("\nErrors:\n");
         printf("  Connect  %u\n", status->connect_errors);
         printf("  Read     %u\n", status->read_errors);
         printf("  Write    %u\n", status->write_errors);
         printf("  Timeout  %u\n", status->timeouts);
+        printf("  Non-2xx  %lu\n", non2xx);
         printf("  Percent  %.2f\n", percent * 100);
     }
 }
+
+
+/*
+ * The connections open at every second, the timeline shows up to 20
+ * spans of the run by their mean.
+ */
+
+#define STATUS_TIMELINE  20
+
+static void print_concurrency(struct status *status) {
+    int i, j, from, to, spans, min;
+    uint64_t sum;
+
+    if (status->sampled == 0) {
+        return;
+    }
+
+    sum = 0;
+    min = 0;
+
+    for (i = 0; i < status->sampled; i++) {
+        sum += status->concurrency[i];
+
+        if (status->concurrency[i] < status->concurrency[min]) {
+            min = i;
+        }
+    }
+
+    printf("\nConcurrency:\n");
+    printf("  Mean      %.1f\n", (double) sum / status->sampled);
+    printf("  Min       %lu at %ds\n", status->concurrency[min], min);
+    printf("  Timeline ");
+
+    spans = min_int(status->sampled, STATUS_TIMELINE);
+
+    for (i = 0; i < spans; i++) {
+        from = i * status->sampled / spans;
+        to = (i + 1) * status->sampled / spans;
+
+        for (j = from, sum = 0; j < to; j++) {
+            sum += status->concurrency[j];
+        }
+
+        printf(" %lu", sum / (to - from));
+    }
+
+    printf("\n");
+}
+
+
+/*
+ * The script time of a thread is part of its latency, except for the
+ * manual collections which run between requests.  The collector steps
+ * of the other modes run inside the hooks and are only counted in it.
+ */
+
+static void print_script(struct status *status, char *name) {
+    char buf1[20], buf2[20];
+    double per_request;
+    uint64_t requests;
+
+    requests = max_int(status->latency->total_count, 1);
+    per_request = (double) status->script_time / 1000 / requests;
+
+    format_time(buf1, status->script_time);
+
+    if (cfg.lua_gc.mode != SCRIPT_GC_MANUAL && status->gc_time == 0) {
+        printf("  %-6s  Script+GC %s  Per Request %.2fus  GC %lu cycles\n",
+               name, buf1, per_request, status->gc_cycles);
+        return;
+    }
+
+    format_time(buf2, status->gc_time);
+
+    printf("  %-6s  Time %s  Per Request %.2fus  GC %s in %lu cycles\n",
+           name, buf1, per_request, buf2, status->gc_cycles);
+}
+
+
+/*
+ * The busy time is the CPU time over the duration, above 100% for
+ * several threads.  A worker close to 100% limits the test itself.
+ */
+
+static void print_counters(struct status *status, char *name, uint64_t time)
+{
+    char buf[20];
+    double requests;
+    uint64_t *val, mask;
+
+    val = status->counters;
+    mask = status->counters_mask;
+    requests = max_int(status->latency->total_count, 1);
+
+    printf("  %-6s", name);
+
+    if (mask & (1 << COUNTER_CPU_TIME)) {
+        printf("  Busy %.1f%%  Time %s",
+               (double) val[COUNTER_CPU_TIME] / 10 / max_int(time, 1),
+               format_time(buf, val[COUNTER_CPU_TIME] / requests));
+    }
+
+    if (mask & (1 << COUNTER_CYCLES)) {
+        printf("  Cycles %.0f", val[COUNTER_CYCLES] / requests);
+    }
+
+    if (mask & (1 << COUNTER_INSTRUCTIONS)) {
+        printf("  Instructions %.0f", val[COUNTER_INSTRUCTIONS] / requests);
+    }
+
+    if ((mask & (1 << COUNTER_CYCLES)) && val[COUNTER_CYCLES] > 0
+        && (mask & (1 << COUNTER_INSTRUCTIONS)))
+    {
+        printf("  IPC %.2f",
+               (double) val[COUNTER_INSTRUCTIONS] / val[COUNTER_CYCLES]);
+    }
+
+    if (mask & (1 << COUNTER_CACHE_MISSES)) {
+        printf("  Cache Misses %.2f", val[COUNTER_CACHE_MISSES] / requests);
+    }
+
+    if (mask & (1 << COUNTER_SWITCHES)) {
+        printf("  Switches %.3f", val[COUNTER_SWITCHES] / requests);
+    }
+
+    if (mask & (1 << COUNTER_FAULTS)) {
+        printf("  Faults %.3f", val[COUNTER_FAULTS] / requests);
+    }
+
+    printf("\n");
+}
+
+
+static double
+loop_busy(struct status *status)
+{
+    uint64_t total;
+
+    total = status->loop_busy + status->loop_wait;
+
+    return (total > 0) ? (double) status->loop_busy * 100 / total : 0;
+}
+
+
+static void print_loop(struct status *status, char *name)
+{
+    char buf1[20], buf2[20];
+    uint64_t wakeups, lag;
+    int i;
+
+    wakeups = 0;
+
+    for (i = 0; i < STATUS_WAKEUPS; i++) {
+        wakeups += status->loop_wakeups[i];
+    }
+
+    lag = status->loop_lag / max_int(status->loop_lags, 1);
+
+    format_time(buf1, lag);
+    format_time(buf2, status->loop_lag_max);
+
+    printf("  %-6s  Busy %.1f%%  Events/Wakeup %.2f  Lag %s  Max %s\n",
+           name, loop_busy(status),
+           (double) status->loop_events / max_int(wakeups, 1), buf1, buf2);
+}
+
+
+static void print_wakeups(struct status *status)
+{
+    int i;
+
+    printf("  Wakeups");
+
+    for (i = 0; i < STATUS_WAKEUPS; i++) {
+        if (status->loop_wakeups[i] == 0) {
+            continue;
+        }
+
+        if (i < 2) {
+            printf("  %d: %lu", i, status->loop_wakeups[i]);
+
+        } else if (i < STATUS_WAKEUPS - 1) {
+            printf("  %d-%d: %lu", 1 << (i - 1), (1 << i) - 1,
+                   status->loop_wakeups[i]);
+
+        } else {
+            printf("  %d+: %lu", 1 << (i - 1), status->loop_wakeups[i]);
+        }
+    }
+
+    printf("\n");
+}
+
+
+/*
+ * A saturated event loop delays sending requests and reading responses,
+ * the latency then measures the client as much as the server.
+ */
+
+static int print_warnings(struct status *status, char *name, int warned)
+{
+    char buf[20];
+    uint64_t lag;
+
+    lag = status->loop_lag / max_int(status->loop_lags, 1);
+
+    if (!warned && (loop_busy(status) > STATUS_BUSY_WARN
+                    || lag > STATUS_LAG_WARN))
+    {
+        printf("\n");
+        warned = 1;
+    }
+
+    if (loop_busy(status) > STATUS_BUSY_WARN) {
+        printf("Warning: %s event loop was %.1f%% busy, the client may "
+               "limit the results\n", name, loop_busy(status));
+    }
+
+    if (lag > STATUS_LAG_WARN) {
+        printf("Warning: %s timers ran %s late on average, the client "
+               "may limit the results\n", name, format_time(buf, lag));
+    }
+
+    return warned;
+}
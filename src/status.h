@@ -4,16 +4,98 @@
 #ifndef STATUS_H
 #define STATUS_H
 
+/* Responses are counted per code from 0 to 599, 1xx to 5xx by class. */
+#define STATUS_CODES    600
+#define STATUS_CLASSES  5
+/* Wakeups by events: 0, 1, 2-3, 4-7 and so on up to 128 and more. */
+#define STATUS_WAKEUPS  9
+/* The values of a group field, the first 32 bytes of up to 16 values. */
+#define STATUS_GROUP_VALUES  16
+#define STATUS_GROUP_VALUE   32
+
+struct status_group_value {
+    char value[STATUS_GROUP_VALUE];
+    uint32_t length;
+    /* The non-2xx responses and the timeouts. */
+    uint64_t errors;
+    hdr_histogram *latency;
+};
+
+struct status_group {
+    uint32_t nvalues;
+    struct status_group_value values[STATUS_GROUP_VALUES];
+    /* The responses whose values found no room. */
+    struct status_group_value other;
+};
+
 struct status {
     uint64_t bytes;
     hdr_histogram *latency;
+    hdr_histogram *class_latency[STATUS_CLASSES];
+    /* From the kernel timestamps of the request and the response. */
+    hdr_histogram *wire_latency;
+    uint64_t codes[STATUS_CODES];
+    uint64_t connects;
+    uint64_t fastopen_connects;
+    uint64_t fastopen_accepted;
+    uint64_t read_grows;
     uint32_t connect_errors;
     uint32_t read_errors;
     uint32_t write_errors;
     uint32_t timeouts;
+    /* The time in ns spent in the script hooks and manual collections. */
+    uint64_t script_time;
+    uint64_t gc_time;
+    uint64_t gc_cycles;
+    /* The counters of the workers, valid by the bits of the mask. */
+    uint64_t counters[COUNTERS];
+    uint64_t counters_mask;
+    /* The event loop, times in ns. */
+    uint64_t loop_busy;
+    uint64_t loop_wait;
+    uint64_t loop_events;
+    uint64_t loop_wakeups[STATUS_WAKEUPS];
+    uint64_t loop_lag;
+    uint64_t loop_lags;
+    uint64_t loop_lag_max;
+    /* The connections handed to other threads. */
+    uint64_t handoffs;
+    /* The open connections, sampled at every second of the run. */
+    uint64_t active;
+    uint64_t start;
+    uint64_t *concurrency;
+    uint32_t seconds;
+    uint32_t sampled;
+    /* The latency by the values of the group fields and by tags. */
+    struct status_group *groups;
+    struct status_group tags;
 };
 
+void status_pool_init(void *, size_t);
+hdr_histogram *status_histogram_create(int64_t, int64_t, int);
 struct status *status_create(void);
+void status_merge(struct status *, struct status *);
+void status_sample(struct status *, uint64_t now);
+struct status_group_value *status_group_find(struct status_group *, char *,
+                                             size_t);
+struct status *status_collect(struct thread *);
+void status_print(struct status *, uint64_t time);
 void status_report(struct thread *, uint64_t time);
+size_t status_encode_size(struct status *);
+char *status_encode(struct status *, char *);
+int status_decode(struct status *, char *, char *);
+
+
+static inline int
+status_wakeup_bucket(int events)
+{
+    int i;
+
+    for (i = 0; events > 0 && i < STATUS_WAKEUPS - 1; i++) {
+        events >>= 1;
+    }
+
+    return i;
+}
 
 #endif /* STATUS_H */
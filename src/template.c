@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#include "headers.h"
+
+/*
+ * A template is the request declared in "http.template", with
+ * placeholders filled in C for every request:
+ *
+ *   {{seq}}            a sequence number unique across threads
+ *   {{rand min max}}   a random integer in [min, max]
+ *   {{uuid}}           a random version 4 UUID
+ *   {{list name}}      a random item of the array http.lists[name]
+ *   {{file path}}      a random line of the file
+ *   {{time}}           the current Unix time in seconds, or
+ *   {{time ms}}        in milliseconds
+ *
+ * The method, path and header values form the head, and the body is
+ * rendered separately so that Content-Length can be fixed up.
+ */
+
+enum {
+    TEMPLATE_TEXT = 0,
+    TEMPLATE_SEQ,
+    TEMPLATE_RAND,
+    TEMPLATE_UUID,
+    TEMPLATE_LIST,
+    TEMPLATE_TIME,
+};
+
+struct template_list {
+    char *name;
+    uint32_t n;
+    size_t max;
+    struct http_field *items;
+    struct template_list *next;
+};
+
+struct template_part {
+    uint8_t type;
+    uint8_t ms;
+    char *text;
+    size_t length;
+    int64_t min;
+    int64_t max;
+    struct template_list *list;
+};
+
+struct template_parts {
+    struct template_part *parts;
+    uint32_t n;
+    uint32_t size;
+    size_t max;
+};
+
+struct template {
+    struct template_parts head;
+    struct template_parts body;
+    uint8_t chunked;
+    char *scratch;
+};
+
+static int template_compile(lua_State *, struct template_parts *,
+    const char *, size_t);
+static int template_placeholder(lua_State *, struct template_part *,
+    char *, char *);
+static int template_int(char *, int64_t *);
+static struct template_part *template_part_add(struct template_parts *);
+static struct template_list *template_list(lua_State *, char *);
+static struct template_list *template_file(char *);
+static char *template_fill(struct template_parts *, char *);
+
+/* Files are loaded once and shared by all threads. */
+static struct template_list *template_files;
+
+static uint64_t template_seq;
+
+
+int
+template_create(lua_State *L, struct template **out)
+{
+    size_t length;
+    const char *body, *te;
+    struct buf *head;
+    struct template *tpl;
+
+    *out = NULL;
+
+    lua_getglobal(L, "http");
+    lua_getfield(L, -1, "template");
+
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return 0;
+    }
+
+    if (cfg.body_file != NULL) {
+        printf("http.template cannot be used with --body\n");
+        return -1;
+    }
+
+    tpl = zcalloc(sizeof(struct template));
+    if (tpl == NULL) {
+        return -1;
+    }
+
+    /* The head is built by script_request() from a copy without body. */
+
+    lua_newtable(L);
+
+    lua_getfield(L, -2, "method");
+    lua_setfield(L, -2, "method");
+
+    lua_getfield(L, -2, "path");
+    lua_setfield(L, -2, "path");
+
+    lua_getfield(L, -2, "headers");
+    lua_setfield(L, -2, "headers");
+
+    head = script_request(L);
+    if (head == NULL) {
+        return -1;
+    }
+
+    lua_getfield(L, -1, "headers");
+    lua_getfield(L, -1, "Transfer-Encoding");
+    te = lua_tostring(L, -1);
+    tpl->chunked = (te != NULL && strcmp(te, "chunked") == 0);
+    lua_pop(L, 3);
+
+    /* Strip the empty line, the Content-Length is inserted before it. */
+    length = head->free - head->start - 2;
+
+    if (template_compile(L, &tpl->head, head->start, length)) {
+        return -1;
+    }
+
+    zfree(head);
+
+    lua_getfield(L, -1, "body");
+    body = lua_tolstring(L, -1, &length);
+
+    if (body != NULL && template_compile(L, &tpl->body, body, length)) {
+        return -1;
+    }
+
+    lua_pop(L, 3);
+
+    tpl->scratch = zmalloc(tpl->body.max + 1);
+    if (tpl->scratch == NULL) {
+        return -1;
+    }
+
+    *out = tpl;
+
+    return 0;
+}
+
+
+size_t
+template_size(struct template *tpl)
+{
+    /* Content-Length or the chunk framing of the body. */
+    return tpl->head.max + 64 + tpl->body.max;
+}
+
+
+void
+template_render(struct template *tpl, struct buf *b)
+{
+    char *p;
+    size_t length;
+
+    length = template_fill(&tpl->body, tpl->scratch) - tpl->scratch;
+
+    p = template_fill(&tpl->head, b->start);
+
+    if (tpl->chunked) {
+        p = cpymem(p, "\r\n", 2);
+
+        if (length > 0) {
+            p += sprintf(p, "%zx\r\n", length);
+            p = cpymem(p, tpl->scratch, length);
+            p = cpymem(p, "\r\n", 2);
+        }
+
+        /* An empty body is still ended by the last chunk. */
+        p = cpymem(p, "0\r\n\r\n", 5);
+
+    } else if (length > 0) {
+        p += sprintf(p, "Content-Length: %zu\r\n\r\n", length);
+        p = cpymem(p, tpl->scratch, length);
+
+    } else {
+        p = cpymem(p, "\r\n", 2);
+    }
+
+    b->pos = b->start;
+    b->free = p;
+}
+
+
+static char *
+template_fill(struct template_parts *parts, char *p)
+{
+    uint32_t i;
+    uint64_t r, span;
+    struct timespec ts;
+    struct http_field *item;
+    struct template_part *part;
+    struct thread *thr = cur_thread();
+
+    for (i = 0; i < parts->n; i++) {
+        part = &parts->parts[i];
+
+        switch (part->type) {
+
+        case TEMPLATE_TEXT:
+            p = cpymem(p, part->text, part->length);
+            break;
+
+        case TEMPLATE_SEQ:
+            r = __atomic_fetch_add(&template_seq, 1, __ATOMIC_RELAXED);
+            p += sprintf(p, "%" PRIu64, r);
+            break;
+
+        case TEMPLATE_RAND:
+            r = random_next(&thr->random);
+            span = (uint64_t) part->max - (uint64_t) part->min + 1;
+
+            /* The full range of int64_t leaves a span of 0. */
+            if (span != 0) {
+                r %= span;
+            }
+
+            p += sprintf(p, "%" PRId64, (int64_t) ((uint64_t) part->min + r));
+            break;
+
+        case TEMPLATE_UUID:
+            r = random_next(&thr->random);
+            p += sprintf(p, "%08x-%04x-4%03x-",
+                         (uint32_t) r, (uint32_t) (r >> 32) & 0xffff,
+                         (uint32_t) (r >> 48) & 0xfff);
+
+            r = random_next(&thr->random);
+            p += sprintf(p, "%04x-%012" PRIx64,
+                         (uint32_t) (0x8000 | (r & 0x3fff)),
+                         (r >> 16) & 0xffffffffffff);
+            break;
+
+        case TEMPLATE_LIST:
+            r = random_next(&thr->random) % part->list->n;
+            item = &part->list->items[r];
+            p = cpymem(p, item->value, item->value_length);
+            break;
+
+        case TEMPLATE_TIME:
+            clock_gettime(CLOCK_REALTIME, &ts);
+
+            if (part->ms) {
+                r = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+            } else {
+                r = ts.tv_sec;
+            }
+
+            p += sprintf(p, "%" PRIu64, r);
+            break;
+        }
+    }
+
+    return p;
+}
+
+
+static int
+template_compile(lua_State *L, struct template_parts *parts,
+    const char *text, size_t length)
+{
+    char *p, *end, *start, *close;
+    struct template_part *part;
+
+    /* The text is kept for the lifetime of the template. */
+
+    start = zmalloc(length + 1);
+    if (start == NULL) {
+        return -1;
+    }
+
+    memcpy(start, text, length);
+    start[length] = '\0';
+
+    end = start + length;
+    p = start;
+
+    while (p < end) {
+        close = NULL;
+        text = strstr(p, "{{");
+
+        if (text != NULL) {
+            close = strstr(text, "}}");
+        }
+
+        if (close == NULL) {
+            text = end;
+        }
+
+        if (text > p) {
+            part = template_part_add(parts);
+            if (part == NULL) {
+                return -1;
+            }
+
+            part->type = TEMPLATE_TEXT;
+            part->text = p;
+            part->length = (char *) text - p;
+
+            parts->max += part->length;
+        }
+
+        if (close == NULL) {
+            break;
+        }
+
+        part = template_part_add(parts);
+        if (part == NULL) {
+            return -1;
+        }
+
+        *close = '\0';
+
+        if (template_placeholder(L, part, (char *) text + 2, close)) {
+            printf("Invalid template placeholder {{%s}}\n", text + 2);
+            return -1;
+        }
+
+        /* The length of a placeholder is the most it can render. */
+        parts->max += part->length;
+
+        p = close + 2;
+    }
+
+    return 0;
+}
+
+
+static int
+template_placeholder(lua_State *L, struct template_part *part, char *p,
+    char *end)
+{
+    char *name, *arg1, *arg2;
+
+    name = strtok(p, " ");
+    arg1 = strtok(NULL, " ");
+    arg2 = strtok(NULL, " ");
+
+    if (name == NULL) {
+        return -1;
+    }
+
+    if (strcmp(name, "seq") == 0) {
+        part->type = TEMPLATE_SEQ;
+        part->length = 20;
+
+    } else if (strcmp(name, "rand") == 0) {
+        if (arg1 == NULL || arg2 == NULL) {
+            return -1;
+        }
+
+        part->type = TEMPLATE_RAND;
+        part->length = 20;
+
+        if (template_int(arg1, &part->min) || template_int(arg2, &part->max)
+            || part->max < part->min)
+        {
+            return -1;
+        }
+
+    } else if (strcmp(name, "uuid") == 0) {
+        part->type = TEMPLATE_UUID;
+        part->length = 36;
+
+    } else if (strcmp(name, "list") == 0 || strcmp(name, "file") == 0) {
+        if (arg1 == NULL) {
+            return -1;
+        }
+
+        part->type = TEMPLATE_LIST;
+        part->list = (name[0] == 'l') ? template_list(L, arg1)
+                                      : template_file(arg1);
+
+        if (part->list == NULL || part->list->n == 0) {
+            return -1;
+        }
+
+        part->length = part->list->max;
+
+    } else if (strcmp(name, "time") == 0) {
+        part->type = TEMPLATE_TIME;
+        part->ms = (arg1 != NULL && strcmp(arg1, "ms") == 0);
+        part->length = 20;
+
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+template_int(char *p, int64_t *value)
+{
+    char *end;
+
+    errno = 0;
+    *value = strtoll(p, &end, 10);
+
+    if (errno != 0 || end == p || *end != '\0') {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static struct template_part *
+template_part_add(struct template_parts *parts)
+{
+    uint32_t size;
+    struct template_part *p;
+
+    if (parts->n == parts->size) {
+        size = (parts->size == 0) ? 8 : parts->size * 2;
+
+        p = zrealloc(parts->parts, size * sizeof(struct template_part));
+        if (p == NULL) {
+            return NULL;
+        }
+
+        parts->parts = p;
+        parts->size = size;
+    }
+
+    p = &parts->parts[parts->n++];
+    memzero(p, sizeof(struct template_part));
+
+    return p;
+}
+
+
+static struct template_list *
+template_list_add(struct template_list *list, char *value, size_t length)
+{
+    uint32_t size;
+    struct http_field *items;
+
+    if ((list->n & (list->n - 1)) == 0) {
+        size = (list->n == 0) ? 8 : list->n * 2;
+
+        items = zrealloc(list->items, size * sizeof(struct http_field));
+        if (items == NULL) {
+            return NULL;
+        }
+
+        list->items = items;
+    }
+
+    list->items[list->n].value = value;
+    list->items[list->n].value_length = length;
+    list->n++;
+
+    list->max = max_int(list->max, length);
+
+    return list;
+}
+
+
+static struct template_list *
+template_list(lua_State *L, char *name)
+{
+    size_t length;
+    const char *value;
+    lua_Integer i, n;
+    struct template_list *list;
+
+    list = zcalloc(sizeof(struct template_list));
+    if (list == NULL) {
+        return NULL;
+    }
+
+    lua_getglobal(L, "http");
+    lua_getfield(L, -1, "lists");
+
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, name);
+
+        if (lua_istable(L, -1)) {
+            n = luaL_len(L, -1);
+
+            for (i = 1; i <= n; i++) {
+                lua_geti(L, -1, i);
+                value = lua_tolstring(L, -1, &length);
+
+                if (value != NULL
+                    && template_list_add(list, strndup(value, length), length)
+                       == NULL)
+                {
+                    return NULL;
+                }
+
+                lua_pop(L, 1);
+            }
+        }
+
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 2);
+
+    return list;
+}
+
+
+static struct template_list *
+template_file(char *path)
+{
+    char *p, *end, *nl, *data;
+    FILE *f;
+    long size;
+    struct template_list *list;
+
+    for (list = template_files; list != NULL; list = list->next) {
+        if (strcmp(list->name, path) == 0) {
+            return list;
+        }
+    }
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        printf("open template file %s failed: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+
+    data = zmalloc(size + 1);
+    list = zcalloc(sizeof(struct template_list));
+
+    if (data == NULL || list == NULL || fread(data, 1, size, f) != size) {
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+
+    end = data + size;
+
+    for (p = data; p < end; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            nl = end;
+        }
+
+        size = (nl > p && nl[-1] == '\r') ? nl - p - 1 : nl - p;
+
+        if (size > 0 && template_list_add(list, p, size) == NULL) {
+            return NULL;
+        }
+    }
+
+    list->name = strdup(path);
+    list->next = template_files;
+    template_files = list;
+
+    return list;
+}
@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) Zhidao HONG
+ */
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+struct template;
+
+int template_create(lua_State *, struct template **);
+size_t template_size(struct template *);
+void template_render(struct template *, struct buf *);
+
+#endif /* TEMPLATE_H */
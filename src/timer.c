@@ -4,6 +4,7 @@
 #include "headers.h"
 
 static intptr_t timer_rbtree_compare(rbtree_node *, rbtree_node *);
+static void timer_lag(event_engine *, uint32_t);
 
 
 void
@@ -112,6 +113,8 @@ timer_find(event_engine *engine)
 void
 timer_expire(event_engine *engine, uint32_t now)
 {
+    int32_t lag;
+    uint32_t run;
     rbtree_node *node, *next;
     struct timer *timer;
     struct timers *timers;
@@ -124,6 +127,12 @@ timer_expire(event_engine *engine, uint32_t now)
         return;
     }
 
+    /*
+     * The timers run after the events of the wakeup, the clock is read
+     * again once for their lag.
+     */
+    run = monotonic_time() / 1000000;
+
     tree = &timers->tree;
 
     for (node = rbtree_min(tree);
@@ -140,6 +149,31 @@ timer_expire(event_engine *engine, uint32_t now)
 
         rbtree_delete(tree, &timer->node);
 
+        lag = msec_diff(run, timer->time);
+
+        if (lag >= 0) {
+            timer_lag(engine, lag);
+        }
+
         timer->handler(timer, NULL);
     }
 }
+
+
+/* The lag of a timer is in whole ms, the unit of its due time. */
+
+static void
+timer_lag(event_engine *engine, uint32_t msec)
+{
+    struct status *status = engine->status;
+    uint64_t lag;
+
+    lag = msec * 1000000ULL;
+
+    status->loop_lag += lag;
+    status->loop_lags++;
+
+    if (lag > status->loop_lag_max) {
+        status->loop_lag_max = lag;
+    }
+}
@@ -6,20 +6,41 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <math.h>
+#include <endian.h>
+#include <time.h>
 #include <pthread.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
 
 #endif /* UNIX_H */
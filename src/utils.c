@@ -159,7 +159,7 @@ parse_url(struct url *u, char *url)
     }
 
     if (path != NULL) {
-        u->path = zmalloc(path_len + 1);
+        u->path = zcalloc(path_len + 1);
         memcpy(u->path, path, path_len);
 
     } else {
@@ -176,7 +176,7 @@ parse_url(struct url *u, char *url)
             return -1;
         }
 
-        u->port = zmalloc(port_len + 1);
+        u->port = zcalloc(port_len + 1);
         memcpy(u->port, port, port_len);
 
         end = p;
@@ -189,7 +189,7 @@ parse_url(struct url *u, char *url)
         return -1;
     }
 
-    u->host = zmalloc(host_len + 1);
+    u->host = zcalloc(host_len + 1);
     memcpy(u->host, host, host_len);
 
     return 0;
@@ -266,27 +266,33 @@ buf_alloc(size_t size)
 }
 
 
+/* The time is in nanoseconds. */
+
 char *
 format_time(char *buf, uint64_t time)
 {
     char *scale;
     double size;
 
-    if (time > 60 * 1000000 - 1) {
-        size = (double) time / (60 * 1000000);
+    if (time > 60 * 1000000000ULL - 1) {
+        size = (double) time / (60 * 1000000000ULL);
         scale = "m";
 
+    } else if (time > 1000000000 - 1) {
+        size = (double) time / 1000000000;
+        scale = "s";
+
     } else if (time > 1000000 - 1) {
         size = (double) time / 1000000;
-        scale = "s";
+        scale = "ms";
 
     } else if (time > 1000 - 1) {
         size = (double) time / 1000;
-        scale = "ms";
+        scale = "us";
 
     } else {
         size = time;
-        scale = "us";
+        scale = "ns";
     }
 
     sprintf(buf, "%.2f%s", size, scale);
@@ -320,3 +326,41 @@ format_byte(char *buf, size_t bytes)
     sprintf(buf, "%.2f%c", size, scale);
     return buf;
 }
+
+
+double tsc_scale;
+uint64_t tsc_base;
+uint64_t tsc_base_time;
+
+
+/* The TSC is calibrated against the monotonic clock for 10ms. */
+
+int
+tsc_init(void)
+{
+#if (HAVE_TSC)
+    unsigned int eax, ebx, ecx, edx;
+    uint64_t start, time, tsc;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)
+        || (edx & (1 << 8)) == 0)
+    {
+        return -1;
+    }
+
+    start = monotonic_time();
+    tsc = __rdtsc();
+
+    do {
+        time = monotonic_time();
+    } while (time - start < 10000000);
+
+    tsc_base = __rdtsc();
+    tsc_base_time = time;
+    tsc_scale = (double) (time - start) / (tsc_base - tsc);
+
+    return 0;
+#else
+    return -1;
+#endif
+}
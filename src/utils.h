@@ -34,6 +34,7 @@ int parse_url(struct url *u, char *url);
 struct addrinfo *addr_resolve(char *host, char *service);
 struct buf *buf_alloc(size_t);
 char *format_time(char *buf, uint64_t time);
+int tsc_init(void);
 char *format_byte(char *buf, size_t bytes);
 
 #define max_int(val1, val2)                                                 \
@@ -79,4 +80,49 @@ static inline uint64_t monotonic_time() {
     return ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+/*
+ * Precise timestamps read an invariant TSC scaled to nanoseconds of
+ * CLOCK_MONOTONIC, or the clock itself when there is no such TSC.
+ */
+
+extern double tsc_scale;
+extern uint64_t tsc_base;
+extern uint64_t tsc_base_time;
+
+static inline uint64_t
+precise_time(void)
+{
+#if (HAVE_TSC)
+    if (tsc_scale > 0) {
+        return tsc_base_time + (uint64_t) ((__rdtsc() - tsc_base) * tsc_scale);
+    }
+#endif
+
+    return monotonic_time();
+}
+
+/* The xorshift64* generator, the state must not be zero. */
+
+static inline uint64_t
+random_next(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+/* Returns a uniform value in [0, 1). */
+
+static inline double
+random_double(uint64_t *state)
+{
+    return (random_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
 #endif /* UTILS_H */